@@ -4,12 +4,14 @@
 # (one bucket is by default 128 pages)
 BUCKET_COUNT=1
 
+# block lines of logstats have the form
+# run <r> block <b> logrecs <n> bytes <n> pids <n> fill <f> density <d>
 AWK_SCRIPT='
     BEGIN {
         prev=-1;
         accum=0;
     }
-    {
+    $1 == "run" {
         accum += $10;
         if ($4 % '"$BUCKET_COUNT"' == 0) {
             totals[$4] += accum;
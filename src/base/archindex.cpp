@@ -0,0 +1,54 @@
+#include "sm_base.h"
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#define private public
+#include "logarchiver.h"
+#undef private
+
+#include "archindex.h"
+
+void IndexInspector::getPIDSplits(LogArchiver::ArchiveIndex* index, size_t n,
+        std::vector<lpid_t>& splits)
+{
+    std::vector<lpid_t> pids;
+    for (size_t r = 0; r < index->runs.size(); r++) {
+        std::vector<LogArchiver::ArchiveIndex::BlockEntry>& entries =
+            index->runs[r].entries;
+        for (size_t i = 0; i < entries.size(); i++) {
+            pids.push_back(entries[i].pid);
+        }
+    }
+
+    if (n <= 1 || pids.empty()) {
+        return;
+    }
+
+    std::sort(pids.begin(), pids.end());
+    for (size_t i = 1; i < n; i++) {
+        lpid_t split = pids[i * pids.size() / n];
+        if (split == lpid_t::null) { continue; }
+        if (!splits.empty() && !(splits.back() < split)) { continue; }
+        splits.push_back(split);
+    }
+}
+
+bool IndexInspector::getRunBlocks(LogArchiver::ArchiveIndex* index,
+        lsn_t runBegin, std::vector<size_t>& offsets,
+        std::vector<lpid_t>& pids)
+{
+    for (size_t r = 0; r < index->runs.size(); r++) {
+        if (index->runs[r].firstLSN != runBegin) { continue; }
+
+        std::vector<LogArchiver::ArchiveIndex::BlockEntry>& entries =
+            index->runs[r].entries;
+        for (size_t i = 0; i < entries.size(); i++) {
+            offsets.push_back(entries[i].offset);
+            pids.push_back(entries[i].pid);
+        }
+        return true;
+    }
+    return false;
+}
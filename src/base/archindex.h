@@ -0,0 +1,34 @@
+#ifndef ARCHINDEX_H
+#define ARCHINDEX_H
+
+#include "sm_base.h"
+#include "logarchiver.h"
+
+#include <vector>
+
+/*
+ * Read-only queries over the in-memory log archive index which are not
+ * exposed by LogArchiver::ArchiveIndex itself. Implemented in a separate
+ * translation unit because it requires access to private index members.
+ */
+class IndexInspector {
+public:
+    /*
+     * Computes at most n - 1 split points which divide the PID domain of
+     * the whole archive into n ranges covering roughly the same number of
+     * blocks. Split points are strictly increasing and never null.
+     */
+    static void getPIDSplits(LogArchiver::ArchiveIndex* index, size_t n,
+            std::vector<lpid_t>& splits);
+
+    /*
+     * Returns the file offsets and first PIDs of the data blocks of the run
+     * which begins at the given LSN, in file order. Returns false if the
+     * index has no such run.
+     */
+    static bool getRunBlocks(LogArchiver::ArchiveIndex* index,
+            lsn_t runBegin, std::vector<size_t>& offsets,
+            std::vector<lpid_t>& pids);
+};
+
+#endif
@@ -20,6 +20,8 @@
 #include "logstats.h"
 #include "logpagestats.h"
 #include "dbinspect.h"
+#include "logexport.h"
+#include "xctstats.h"
 #include "experiments/restore_cmd.h"
 
 /*
@@ -57,6 +59,8 @@ void Command::init()
     REGISTER_COMMAND("logstats", LogStats);
     REGISTER_COMMAND("logpagestats", LogPageStats);
     REGISTER_COMMAND("dbinspect", DBInspect);
+    REGISTER_COMMAND("export", LogExport);
+    REGISTER_COMMAND("xctstats", XctStats);
     REGISTER_COMMAND("kits", KitsCommand);
     REGISTER_COMMAND("restore", RestoreCmd);
 }
@@ -288,10 +292,25 @@ BaseScanner* LogScannerCommand::getScanner(
         bitset<logrec_t::t_max_logrec>* filter)
 {
     BaseScanner* s;
+    if (follow && (isArchive || threads > 1 || useMmap)) {
+        throw runtime_error("--follow cannot be combined with --archive, "
+                "--threads or --mmap");
+    }
+    if (useMmap && (isArchive || threads > 1)) {
+        throw runtime_error("--mmap cannot be combined with --archive or "
+                "--threads");
+    }
+
     if (isArchive) {
         if (merge) s = new MergeScanner(optionValues);
         else s = new LogArchiveScanner(optionValues);
     }
+    else if (threads > 1) {
+        s = new ParallelBlockScanner(optionValues, filter);
+    }
+    else if (useMmap) {
+        s = new MmapScanner(optionValues, filter);
+    }
     else {
         s = new BlockScanner(optionValues, filter);
     }
@@ -320,6 +339,43 @@ void LogScannerCommand::setupOptions()
             "Merge archiver input so that global sort order is produced")
         ("limit,n", po::value<size_t>(&limit)->default_value(0),
              "Number of log records to scan")
+        ("from-lsn", po::value<string>()->default_value(""),
+            "Scan only log records with LSN >= given <partition>.<offset>, \
+            which must be the LSN of a log record (e.g., printed by logcat)")
+        ("to-lsn", po::value<string>()->default_value(""),
+            "Scan only log records with LSN < given <partition>.<offset>")
+        ("from-tick", po::value<long>()->default_value(0),
+            "Scan only log records after the given number of ticks")
+        ("to-tick", po::value<long>()->default_value(-1),
+            "Stop scanning after the given number of ticks (-1 for none)")
+        ("pid-from", po::value<string>()->default_value(""),
+            "Scan only log records of pages >= given <volume>.<store>.<page>")
+        ("pid-to", po::value<string>()->default_value(""),
+            "Scan only log records of pages <= given <volume>.<store>.<page>")
+        ("pid-list", po::value<string>()->default_value(""),
+            "File with one <volume>.<store>.<page> per line; scan only log \
+            records of these pages")
+        ("readahead", po::value<size_t>()->default_value(4),
+            "Number of log blocks read ahead by a background I/O thread \
+            (minimum 2)")
+        ("mmap", po::value<bool>(&useMmap)->default_value(false)
+         ->implicit_value(true),
+            "Map log partitions into memory instead of reading them into \
+            a buffer (read-only commands only)")
+        ("threads", po::value<size_t>(&threads)->default_value(1),
+            "Number of threads used to scan log partitions or archive runs \
+            in parallel")
+        ("unordered", po::value<bool>(&unordered)->default_value(false)
+         ->implicit_value(true),
+            "With --threads, deliver records as soon as they are decoded \
+            instead of in LSN order (only for order-independent commands)")
+        ("follow", po::value<bool>(&follow)->default_value(false)
+         ->implicit_value(true),
+            "Once the end of the log is reached, keep waiting for new log \
+            records (stop with Ctrl-C)")
+        ("cursor", po::value<string>()->default_value(""),
+            "File where the scan position and handler state are saved; if \
+            it exists, only log written since the previous run is scanned")
         ;
     options.add(logscanner);
 }
@@ -58,6 +58,10 @@ protected:
     bool isArchive;
     bool merge;
     string filename;
+    size_t threads;
+    bool unordered;
+    bool useMmap;
+    bool follow;
 
 private:
     BaseScanner* scanner;
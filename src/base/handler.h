@@ -15,8 +15,36 @@ public:
     virtual void invoke(logrec_t &r) = 0;
     virtual void finalize() = 0;
 
+    // Invoked with a batch of log records (e.g., all records of a block)
+    // by scanners that support it. Records are only valid during the call.
+    virtual void invokeBatch(logrec_t** recs, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            invoke(*recs[i]);
+        }
+    }
+
     virtual void newFile(const char* /* fname */) {};
 
+    /*
+     * Scanners which process their input on several threads may give each
+     * thread its own clone of a handler. A clone has the same configuration
+     * as the original but empty results; once all threads are done, each
+     * clone is passed to merge() on the original, and only the original is
+     * finalized. Handlers which cannot be cloned return NULL.
+     */
+    virtual Handler* clone() { return NULL; }
+    virtual void merge(Handler* /* clone */) {};
+
+    /*
+     * State persisted in the cursor file of incremental scans (--cursor).
+     * loadState is called before the first record is delivered and
+     * saveState right before finalize, so that results accumulate across
+     * runs which each scan only the log written since the previous one.
+     */
+    virtual void saveState(std::ostream& /* out */) {};
+    virtual void loadState(std::istream& /* in */) {};
+
     virtual ~Handler() {};
 };
 
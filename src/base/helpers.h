@@ -0,0 +1,31 @@
+#ifndef HELPERS_H
+#define HELPERS_H
+
+#include "sm_base.h"
+#include "logarchiver.h"
+
+/*
+ * Orders the file names of log archive runs by their begin LSN
+ */
+inline bool runCompare(const string& a, const string& b)
+{
+    return LogArchiver::ArchiveDirectory::parseLSN(a.c_str(), false) <
+        LogArchiver::ArchiveDirectory::parseLSN(b.c_str(), false);
+}
+
+/*
+ * Bucket of a histogram with the given number of buckets, where bucket b
+ * counts values in [2^b, 2^(b+1)). Values 0 and 1 fall into bucket 0, and
+ * values too large for the histogram into the last bucket.
+ */
+inline size_t log2Bucket(uint64_t value, size_t buckets)
+{
+    size_t b = 0;
+    while (value > 1 && b < buckets - 1) {
+        value >>= 1;
+        b++;
+    }
+    return b;
+}
+
+#endif
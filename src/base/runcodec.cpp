@@ -0,0 +1,460 @@
+#include "runcodec.h"
+#include "archindex.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+const string RunCodec::PREFIX = "lz_";
+
+static_assert(sizeof(RunCodec::BlockEntry) == 40,
+        "BlockEntry must not contain implicit padding");
+static_assert(sizeof(RunCodec::Footer) == 24,
+        "Footer must not contain implicit padding");
+
+// Header bytes of each record which are delta-encoded; they cover the
+// length, type, volume and page fields of the log record header
+const size_t HEADER_DELTA = 16;
+
+// LZ77 parameters: minimum match, hash table size and maximum distance
+const size_t MIN_MATCH = 4;
+const size_t HASH_BITS = 16;
+const size_t MAX_OFFSET = 65535;
+
+static void putLength(std::vector<char>& out, size_t length)
+{
+    while (length >= 255) {
+        out.push_back((char) 255);
+        length -= 255;
+    }
+    out.push_back((char) length);
+}
+
+static size_t getLength(const unsigned char* src, size_t length, size_t& pos)
+{
+    size_t value = 0;
+    unsigned char b;
+    do {
+        if (pos >= length) {
+            throw runtime_error("Corrupt compressed block");
+        }
+        b = src[pos++];
+        value += b;
+    } while (b == 255);
+    return value;
+}
+
+/*
+ * A sequence consists of a token with the literal length in the high and
+ * the match length minus MIN_MATCH in the low nibble, the remainder of
+ * lengths which do not fit into a nibble, the literals and, except for the
+ * last sequence of a block, a two-byte match offset.
+ */
+static void putSequence(std::vector<char>& out, const char* literals,
+        size_t litLength, size_t offset, size_t matchLength)
+{
+    size_t m = matchLength > 0 ? matchLength - MIN_MATCH : 0;
+    unsigned char token = (std::min<size_t>(litLength, 15) << 4)
+        | std::min<size_t>(m, 15);
+    out.push_back((char) token);
+    if (litLength >= 15) {
+        putLength(out, litLength - 15);
+    }
+    out.insert(out.end(), literals, literals + litLength);
+
+    if (matchLength > 0) {
+        out.push_back((char) (offset & 0xFF));
+        out.push_back((char) (offset >> 8));
+        if (m >= 15) {
+            putLength(out, m - 15);
+        }
+    }
+}
+
+static void lzCompress(const char* src, size_t length, std::vector<char>& out)
+{
+    std::vector<uint32_t> table(1 << HASH_BITS, 0);
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    while (pos + MIN_MATCH <= length) {
+        uint32_t seq;
+        memcpy(&seq, src + pos, sizeof(seq));
+        uint32_t h = (seq * 2654435761U) >> (32 - HASH_BITS);
+        // positions are stored plus one, so that zero means empty
+        size_t candidate = table[h];
+        table[h] = pos + 1;
+
+        if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET
+                || memcmp(src + candidate - 1, src + pos, MIN_MATCH) != 0)
+        {
+            pos++;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t matchLength = MIN_MATCH;
+        while (pos + matchLength < length
+                && src[match + matchLength] == src[pos + matchLength])
+        {
+            matchLength++;
+        }
+
+        putSequence(out, src + anchor, pos - anchor, pos - match,
+                matchLength);
+        pos += matchLength;
+        anchor = pos;
+    }
+
+    putSequence(out, src + anchor, length - anchor, 0, 0);
+}
+
+static void lzDecompress(const char* input, size_t length, char* dst,
+        size_t rawSize)
+{
+    const unsigned char* src = (const unsigned char*) input;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < length) {
+        unsigned char token = src[ip++];
+
+        size_t litLength = token >> 4;
+        if (litLength == 15) {
+            litLength += getLength(src, length, ip);
+        }
+        if (ip + litLength > length || op + litLength > rawSize) {
+            throw runtime_error("Corrupt compressed block");
+        }
+        memcpy(dst + op, src + ip, litLength);
+        ip += litLength;
+        op += litLength;
+
+        // last sequence has no match
+        if (ip == length) { break; }
+
+        if (ip + 2 > length) {
+            throw runtime_error("Corrupt compressed block");
+        }
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        size_t matchLength = (token & 15) + MIN_MATCH;
+        if ((token & 15) == 15) {
+            matchLength += getLength(src, length, ip);
+        }
+        if (offset == 0 || offset > op || op + matchLength > rawSize) {
+            throw runtime_error("Corrupt compressed block");
+        }
+
+        // byte by byte, since the match may overlap the output
+        for (size_t i = 0; i < matchLength; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+
+    if (op != rawSize) {
+        throw runtime_error("Corrupt compressed block");
+    }
+}
+
+/*
+ * Returns the number of consecutive records, starting at the beginning of
+ * the block, whose headers can be delta-encoded. The same walk is performed
+ * on the decoded data, so it only has to be deterministic.
+ */
+static size_t countRecords(const char* block, size_t length)
+{
+    size_t count = 0;
+    size_t pos = 0;
+    while (pos + HEADER_DELTA <= length) {
+        size_t len = ((const logrec_t*) (block + pos))->length();
+        if (len < HEADER_DELTA || pos + len > length) { break; }
+        pos += len;
+        count++;
+    }
+    return count;
+}
+
+RunCodec::Codec RunCodec::compressBlock(const char* src, size_t length,
+        std::vector<char>& out)
+{
+    out.clear();
+
+    uint32_t records = countRecords(src, length);
+    std::vector<char> delta(src, src + length);
+    size_t prev = 0;
+    size_t pos = records > 0 ? ((const logrec_t*) src)->length() : 0;
+    for (size_t r = 1; r < records; r++) {
+        size_t len = ((const logrec_t*) (src + pos))->length();
+        for (size_t k = 0; k < HEADER_DELTA; k++) {
+            delta[pos + k] = src[pos + k] - src[prev + k];
+        }
+        prev = pos;
+        pos += len;
+    }
+
+    out.resize(sizeof(records));
+    memcpy(out.data(), &records, sizeof(records));
+    lzCompress(delta.data(), length, out);
+
+    if (out.size() >= length) {
+        out.assign(src, src + length);
+        return STORED;
+    }
+    return DELTA_LZ;
+}
+
+void RunCodec::decompressBlock(Codec codec, const char* src, size_t length,
+        char* dst, size_t rawSize)
+{
+    if (codec == STORED) {
+        if (length != rawSize) {
+            throw runtime_error("Corrupt compressed block");
+        }
+        memcpy(dst, src, rawSize);
+        return;
+    }
+
+    uint32_t records;
+    if (codec != DELTA_LZ || length < sizeof(records)) {
+        throw runtime_error("Corrupt compressed block");
+    }
+    memcpy(&records, src, sizeof(records));
+    lzDecompress(src + sizeof(records), length - sizeof(records), dst,
+            rawSize);
+
+    size_t prev = 0;
+    size_t pos = records > 0 ? ((logrec_t*) dst)->length() : 0;
+    for (size_t r = 1; r < records; r++) {
+        if (pos + HEADER_DELTA > rawSize) {
+            throw runtime_error("Corrupt compressed block");
+        }
+        for (size_t k = 0; k < HEADER_DELTA; k++) {
+            dst[pos + k] += dst[prev + k];
+        }
+        prev = pos;
+        pos += ((logrec_t*) (dst + pos))->length();
+    }
+}
+
+void RunCodec::compressRun(LogArchiver::ArchiveDirectory& dir,
+        const string& fname, size_t& rawBytes, size_t& bytes)
+{
+    lsn_t runBegin = LogArchiver::ArchiveDirectory::parseLSN(fname.c_str(),
+            false);
+    std::vector<size_t> offsets;
+    std::vector<lpid_t> firstPIDs;
+    if (!IndexInspector::getRunBlocks(dir.getIndex(), runBegin, offsets,
+                firstPIDs))
+    {
+        throw runtime_error("Run not found in archive index: " + fname);
+    }
+
+    string path = dir.getArchDir() + "/" + fname;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Could not open run file " + path);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    size_t indexBlocks = 0, dataBlocks = 0;
+    W_COERCE(dir.getIndex()->getBlockCounts(fd, &indexBlocks, &dataBlocks));
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw runtime_error("Could not stat run file " + path);
+    }
+    size_t dataEnd = st.st_size - indexBlocks * dir.getBlockSize();
+
+    // written under a temporary name, so that a failure leaves no partial run
+    string outPath = dir.getArchDir() + "/" + PREFIX + fname;
+    string tmpPath = outPath + ".tmp";
+    std::ofstream out(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out.good()) {
+        ::close(fd);
+        throw runtime_error("Could not create file " + tmpPath);
+    }
+
+    std::vector<BlockEntry> blocks;
+    std::vector<char> block;
+    std::vector<char> compressed;
+    size_t outOffset = 0;
+    rawBytes = 0;
+
+    for (size_t b = 0; b < offsets.size(); b++) {
+        size_t end = b + 1 < offsets.size() ? offsets[b + 1] : dataEnd;
+        size_t length = end - offsets[b];
+        block.resize(length);
+
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = ::pread(fd, block.data() + done, length - done,
+                    offsets[b] + done);
+            if (n <= 0) {
+                ::close(fd);
+                throw runtime_error("Error reading run file " + path);
+            }
+            done += n;
+        }
+
+        BlockEntry entry;
+        entry.rawOffset = offsets[b];
+        entry.offset = outOffset;
+        entry.rawSize = length;
+        entry.codec = compressBlock(block.data(), length, compressed);
+        entry.size = compressed.size();
+        entry.setFirstPID(firstPIDs[b]);
+        blocks.push_back(entry);
+
+        out.write(compressed.data(), compressed.size());
+        outOffset += compressed.size();
+        rawBytes += length;
+    }
+    ::close(fd);
+
+    Footer footer;
+    footer.blocks = blocks.size();
+    footer.rawBytes = rawBytes;
+    footer.magic = MAGIC;
+    out.write((const char*) blocks.data(), blocks.size() * sizeof(BlockEntry));
+    out.write((const char*) &footer, sizeof(Footer));
+    out.close();
+    if (out.fail()) {
+        throw runtime_error("Error writing file " + tmpPath);
+    }
+
+    bytes = outOffset + blocks.size() * sizeof(BlockEntry) + sizeof(Footer);
+
+    if (::rename(tmpPath.c_str(), outPath.c_str()) != 0) {
+        throw runtime_error("Could not rename " + tmpPath);
+    }
+}
+
+void RunCodec::compressDirectory(LogArchiver::ArchiveDirectory& dir)
+{
+    std::vector<string> files;
+    dir.listFiles(files);
+    std::sort(files.begin(), files.end());
+
+    size_t totalRaw = 0, total = 0, count = 0;
+    struct stat st;
+    for (size_t i = 0; i < files.size(); i++) {
+        string outPath = dir.getArchDir() + "/" + PREFIX + files[i];
+        if (::stat(outPath.c_str(), &st) == 0) { continue; }
+
+        size_t rawBytes = 0, bytes = 0;
+        compressRun(dir, files[i], rawBytes, bytes);
+        count++;
+        totalRaw += rawBytes;
+        total += bytes;
+
+        cout << "compressed=" << files[i]
+            << " raw_bytes=" << rawBytes
+            << " bytes=" << bytes
+            << " ratio=" << (bytes > 0 ? (double) rawBytes / bytes : 0)
+            << endl;
+    }
+
+    cout << "compressed_runs=" << count
+        << " raw_bytes=" << totalRaw
+        << " bytes=" << total
+        << " ratio=" << (total > 0 ? (double) totalRaw / total : 0)
+        << endl;
+}
+
+void RunCodec::listRuns(const string& archdir, std::vector<string>& runs)
+{
+    os_dir_t dir = os_opendir(archdir.c_str());
+    if (!dir) {
+        throw runtime_error("Could not open archive directory " + archdir);
+    }
+
+    os_dirent_t* entry = os_readdir(dir);
+    while (entry != NULL) {
+        string fname = entry->d_name;
+        if (fname.size() > PREFIX.size() &&
+                fname.compare(0, PREFIX.size(), PREFIX) == 0 &&
+                fname.compare(fname.size() - 4, 4, ".tmp") != 0)
+        {
+            runs.push_back(fname.substr(PREFIX.size()));
+        }
+        entry = os_readdir(dir);
+    }
+    os_closedir(dir);
+}
+
+CompressedRunReader::CompressedRunReader(const string& path)
+    : path(path), rawBytes(0), bytesRead(0), rawBytesRead(0)
+{
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Could not open compressed run " + path);
+    }
+
+    struct stat st;
+    RunCodec::Footer footer;
+    if (::fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(footer) ||
+            ::pread(fd, &footer, sizeof(footer), st.st_size - sizeof(footer))
+                != (ssize_t) sizeof(footer) ||
+            footer.magic != RunCodec::MAGIC)
+    {
+        ::close(fd);
+        throw runtime_error("Invalid compressed run " + path);
+    }
+
+    size_t tableSize = footer.blocks * sizeof(RunCodec::BlockEntry);
+    blocks.resize(footer.blocks);
+    if (tableSize + sizeof(footer) > (size_t) st.st_size ||
+            ::pread(fd, blocks.data(), tableSize,
+                st.st_size - sizeof(footer) - tableSize)
+                != (ssize_t) tableSize)
+    {
+        ::close(fd);
+        throw runtime_error("Invalid compressed run " + path);
+    }
+    rawBytes = footer.rawBytes;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+CompressedRunReader::~CompressedRunReader()
+{
+    ::close(fd);
+}
+
+size_t CompressedRunReader::findBlock(lpid_t pid) const
+{
+    size_t b = 0;
+    while (b + 1 < blocks.size()
+            && blocks[b + 1].getFirstPID() != lpid_t::null
+            && !(pid < blocks[b + 1].getFirstPID()))
+    {
+        b++;
+    }
+    return b;
+}
+
+size_t CompressedRunReader::readBlock(size_t i, std::vector<char>& buffer)
+{
+    const RunCodec::BlockEntry& entry = blocks[i];
+    input.resize(entry.size);
+    size_t done = 0;
+    while (done < entry.size) {
+        ssize_t n = ::pread(fd, input.data() + done, entry.size - done,
+                entry.offset + done);
+        if (n <= 0) {
+            throw runtime_error("Error reading compressed run " + path);
+        }
+        done += n;
+    }
+
+    buffer.resize(entry.rawSize);
+    RunCodec::decompressBlock((RunCodec::Codec) entry.codec, input.data(),
+            entry.size, buffer.data(), entry.rawSize);
+    bytesRead += entry.size;
+    rawBytesRead += entry.rawSize;
+    return entry.rawSize;
+}
@@ -0,0 +1,149 @@
+#ifndef RUNCODEC_H
+#define RUNCODEC_H
+
+#include "sm_base.h"
+#include "logarchiver.h"
+
+#include <cstring>
+#include <vector>
+
+/*
+ * Block-level compression of log archive runs. Since runs are sorted by
+ * PID, consecutive log records mostly belong to the same page and their
+ * headers differ in a few bytes only. Each block is therefore first
+ * delta-encoded, replacing the header bytes of each record with their
+ * difference to the header of the previous record, and then compressed with
+ * a simple LZ77 coder in the style of LZ4.
+ *
+ * A compressed run is stored in a file named after the original run with
+ * PREFIX prepended, so that it is not taken for a run by the archive
+ * directory. It contains the compressed blocks back to back, followed by a
+ * table with one BlockEntry per block and a Footer. Blocks which do not
+ * compress are stored unchanged.
+ *
+ * Only LogArchiveScanner and RunFilter decode compressed runs, so the
+ * original run is kept next to its compressed copy for restore, mergeruns
+ * and the other tools reading the archive.
+ */
+class RunCodec {
+public:
+    static const string PREFIX;
+
+    enum Codec {
+        STORED = 0,
+        DELTA_LZ = 1
+    };
+
+    /*
+     * The block table and footer are written as they are in memory, so
+     * they only have fixed-width fields without implicit padding, and are
+     * zero-initialized by their constructors.
+     */
+    struct BlockEntry {
+        // offset of the block in the original and in the compressed run
+        uint64_t rawOffset;
+        uint64_t offset;
+        uint32_t rawSize;
+        uint32_t size;
+        uint32_t codec;
+        // first PID of the block, whose fields are stored separately
+        uint32_t firstStore;
+        uint32_t firstPage;
+        uint16_t firstVol;
+        uint16_t padding;
+
+        BlockEntry() { memset(this, 0, sizeof(BlockEntry)); }
+
+        lpid_t getFirstPID() const
+        {
+            return lpid_t(firstVol, firstStore, firstPage);
+        }
+
+        void setFirstPID(const lpid_t& pid)
+        {
+            firstVol = pid.vol();
+            firstStore = pid.store();
+            firstPage = pid.page;
+        }
+    };
+
+    struct Footer {
+        uint64_t blocks;
+        uint64_t rawBytes;
+        uint64_t magic;
+
+        Footer() { memset(this, 0, sizeof(Footer)); }
+    };
+
+    static const uint64_t MAGIC = 0x326e75725a4cULL;
+
+    /*
+     * Compresses a block of log records into out, returning the codec used.
+     */
+    static Codec compressBlock(const char* src, size_t length,
+            std::vector<char>& out);
+
+    /*
+     * Decompresses a block into dst, which must hold rawSize bytes. Throws
+     * if the compressed data is corrupt.
+     */
+    static void decompressBlock(Codec codec, const char* src, size_t length,
+            char* dst, size_t rawSize);
+
+    /*
+     * Compresses run fname of the given archive directory into a file with
+     * PREFIX prepended. Returns the size of the original and of the
+     * compressed run.
+     */
+    static void compressRun(LogArchiver::ArchiveDirectory& dir,
+            const string& fname, size_t& rawBytes, size_t& bytes);
+
+    /*
+     * Compresses all runs of an archive directory which were not compressed
+     * yet, printing the compression ratio of each run.
+     */
+    static void compressDirectory(LogArchiver::ArchiveDirectory& dir);
+
+    /*
+     * Lists the compressed runs of a directory, with PREFIX removed, i.e.,
+     * under the names of the original runs.
+     */
+    static void listRuns(const string& archdir, std::vector<string>& runs);
+};
+
+/*
+ * Reads the blocks of a compressed run.
+ */
+class CompressedRunReader {
+public:
+    CompressedRunReader(const string& path);
+    ~CompressedRunReader();
+
+    size_t getBlockCount() const { return blocks.size(); }
+    const RunCodec::BlockEntry& getBlock(size_t i) const { return blocks[i]; }
+    size_t getRawBytes() const { return rawBytes; }
+    size_t getBytesRead() const { return bytesRead; }
+    size_t getRawBytesRead() const { return rawBytesRead; }
+
+    /*
+     * Returns the first block to be read for records of the given PID,
+     * i.e., the last one whose first PID is not larger.
+     */
+    size_t findBlock(lpid_t pid) const;
+
+    /*
+     * Reads and decompresses block i into buffer, returning its size.
+     */
+    size_t readBlock(size_t i, std::vector<char>& buffer);
+
+private:
+    string path;
+    int fd;
+    size_t rawBytes;
+    size_t bytesRead;
+    size_t rawBytesRead;
+    std::vector<RunCodec::BlockEntry> blocks;
+    std::vector<char> input;
+};
+
+#endif
@@ -0,0 +1,211 @@
+#include "runfilter.h"
+#include "runcodec.h"
+
+#include <cmath>
+#include <fstream>
+
+#include <sys/stat.h>
+
+const string RunFilter::PREFIX = "bloom_";
+
+static uint64_t pidHash(lpid_t pid)
+{
+    uint64_t k = ((uint64_t) pid.store() << 32) | pid.page;
+    k ^= (uint64_t) pid.vol() << 56;
+    // murmur3 finalizer
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+RunFilter::RunFilter()
+    : numBits(0), hashes(0), pids(0)
+{}
+
+void RunFilter::init(size_t pids, size_t bitsPerPID)
+{
+    this->pids = pids;
+    numBits = std::max<size_t>(64, pids * bitsPerPID);
+    // optimal number of hash functions is ln 2 times bits per key
+    hashes = std::max<size_t>(1, std::round(bitsPerPID * 0.69));
+    bits.assign((numBits + 7) / 8, 0);
+}
+
+/*
+ * The hash functions are derived from two halves of a single hash, as
+ * h1 + i * h2 (Kirsch and Mitzenmacher).
+ */
+void RunFilter::add(lpid_t pid)
+{
+    uint64_t h = pidHash(pid);
+    uint64_t h1 = h & 0xFFFFFFFF;
+    uint64_t h2 = (h >> 32) | 1;
+    for (size_t i = 0; i < hashes; i++) {
+        size_t b = (h1 + i * h2) % numBits;
+        bits[b / 8] |= 1 << (b % 8);
+    }
+}
+
+bool RunFilter::mayContain(lpid_t pid) const
+{
+    uint64_t h = pidHash(pid);
+    uint64_t h1 = h & 0xFFFFFFFF;
+    uint64_t h2 = (h >> 32) | 1;
+    for (size_t i = 0; i < hashes; i++) {
+        size_t b = (h1 + i * h2) % numBits;
+        if ((bits[b / 8] & (1 << (b % 8))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RunFilter::mayContainRange(lpid_t begin, lpid_t end) const
+{
+    if (begin == lpid_t::null || end == lpid_t::null) { return true; }
+    if (begin.vol() != end.vol() || begin.store() != end.store()) {
+        return true;
+    }
+    if (end.page <= begin.page || end.page - begin.page > MAX_RANGE_PAGES) {
+        return true;
+    }
+
+    for (shpid_t p = begin.page; p < end.page; p++) {
+        if (mayContain(lpid_t(begin.vol(), begin.store(), p))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void RunFilter::save(const string& path) const
+{
+    Header header;
+    header.magic = MAGIC;
+    header.bits = numBits;
+    header.hashes = hashes;
+    header.pids = pids;
+
+    // written under a temporary name, so that a filter is either complete
+    // or missing
+    string tmpPath = path + ".tmp";
+    std::ofstream out(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+    out.write((const char*) &header, sizeof(Header));
+    out.write((const char*) bits.data(), bits.size());
+    out.close();
+    if (out.fail()) {
+        throw runtime_error("Error writing file " + tmpPath);
+    }
+    if (::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        throw runtime_error("Could not rename " + tmpPath);
+    }
+}
+
+bool RunFilter::load(const string& path)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in.good()) {
+        return false;
+    }
+
+    Header header;
+    in.read((char*) &header, sizeof(Header));
+    if (in.fail() || header.magic != MAGIC || header.bits == 0) {
+        throw runtime_error("Invalid run filter " + path);
+    }
+
+    numBits = header.bits;
+    hashes = header.hashes;
+    pids = header.pids;
+    bits.resize((numBits + 7) / 8);
+    in.read((char*) bits.data(), bits.size());
+    if (in.fail()) {
+        throw runtime_error("Invalid run filter " + path);
+    }
+    return true;
+}
+
+/*
+ * Records of a run are sorted by PID, so distinct PIDs are collected by
+ * comparing each PID with the previous one.
+ */
+static void addPID(std::vector<lpid_t>& pids, logrec_t* lr)
+{
+    if (lr->null_pid()) { return; }
+    if (pids.empty() || pids.back() != lr->pid()) {
+        pids.push_back(lr->pid());
+    }
+}
+
+static void buildFilter(const string& path, const string& run,
+        std::vector<lpid_t>& pids, size_t bitsPerPID)
+{
+    RunFilter filter;
+    filter.init(pids.size(), bitsPerPID);
+    for (size_t i = 0; i < pids.size(); i++) {
+        filter.add(pids[i]);
+    }
+    filter.save(path);
+
+    cout << "filter=" << run
+        << " pids=" << pids.size()
+        << " bytes=" << filter.getSize()
+        << endl;
+}
+
+void RunFilter::buildDirectory(LogArchiver::ArchiveDirectory& dir,
+        size_t bitsPerPID)
+{
+    string archdir = dir.getArchDir();
+    struct stat st;
+
+    std::vector<string> runs;
+    dir.listFiles(runs);
+    for (size_t i = 0; i < runs.size(); i++) {
+        string path = archdir + "/" + PREFIX + runs[i];
+        if (::stat(path.c_str(), &st) == 0) { continue; }
+        // runs which were compressed are handled below
+        string runPath = archdir + "/" + runs[i];
+        if (::stat(runPath.c_str(), &st) != 0) { continue; }
+
+        lsn_t begin = LogArchiver::ArchiveDirectory::parseLSN(
+                runs[i].c_str(), false);
+        lsn_t end = LogArchiver::ArchiveDirectory::parseLSN(
+                runs[i].c_str(), true);
+        LogArchiver::ArchiveScanner::RunScanner rs(begin, end,
+                lpid_t::null, lpid_t::null, 0, &dir);
+
+        std::vector<lpid_t> pids;
+        logrec_t* lr;
+        while (rs.next(lr)) {
+            addPID(pids, lr);
+        }
+        buildFilter(path, runs[i], pids, bitsPerPID);
+    }
+
+    std::vector<string> compressed;
+    RunCodec::listRuns(archdir, compressed);
+    for (size_t i = 0; i < compressed.size(); i++) {
+        string path = archdir + "/" + PREFIX + compressed[i];
+        if (::stat(path.c_str(), &st) == 0) { continue; }
+
+        CompressedRunReader reader(archdir + "/" + RunCodec::PREFIX
+                + compressed[i]);
+        std::vector<char> block;
+        std::vector<lpid_t> pids;
+        for (size_t b = 0; b < reader.getBlockCount(); b++) {
+            size_t length = reader.readBlock(b, block);
+            size_t pos = 0;
+            while (pos < length) {
+                logrec_t* lr = (logrec_t*) (block.data() + pos);
+                if (lr->length() == 0) { break; }
+                addPID(pids, lr);
+                pos += lr->length();
+            }
+        }
+        buildFilter(path, compressed[i], pids, bitsPerPID);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef RUNFILTER_H
+#define RUNFILTER_H
+
+#include "sm_base.h"
+#include "logarchiver.h"
+
+#include <vector>
+
+/*
+ * Bloom filter over the PIDs of the log records in an archive run, which
+ * tells whether a run may contain records of a given page without reading
+ * any of its blocks. Used to skip runs entirely when scanning only a few
+ * pages or a small segment of pages.
+ *
+ * The filter of a run is stored in a file named after the run with PREFIX
+ * prepended, next to the run itself. Since runs are never modified, a filter
+ * stays valid until its run is deleted.
+ */
+class RunFilter {
+public:
+    static const string PREFIX;
+
+    // Ranges with more pages are not probed page by page
+    static const size_t MAX_RANGE_PAGES = 4096;
+
+    RunFilter();
+
+    /*
+     * Sizes the filter for the given number of distinct PIDs.
+     */
+    void init(size_t pids, size_t bitsPerPID);
+
+    void add(lpid_t pid);
+    bool mayContain(lpid_t pid) const;
+
+    /*
+     * Whether the run may contain any PID in [begin, end), where a null PID
+     * is an open bound. Only ranges within a store of at most
+     * MAX_RANGE_PAGES pages are actually checked.
+     */
+    bool mayContainRange(lpid_t begin, lpid_t end) const;
+
+    void save(const string& path) const;
+    bool load(const string& path);
+
+    size_t getSize() const { return bits.size(); }
+
+    /*
+     * Builds the filters of all runs of an archive directory, compressed or
+     * not, which do not have one yet.
+     */
+    static void buildDirectory(LogArchiver::ArchiveDirectory& dir,
+            size_t bitsPerPID);
+
+private:
+    struct Header {
+        uint64_t magic;
+        uint64_t bits;
+        uint64_t hashes;
+        uint64_t pids;
+    };
+
+    static const uint64_t MAGIC = 0x31726c69667552ULL;
+
+    std::vector<unsigned char> bits;
+    size_t numBits;
+    size_t hashes;
+    size_t pids;
+};
+
+#endif
@@ -1,34 +1,461 @@
 #include "scanner.h"
+#include "archindex.h"
+#include "helpers.h"
+#include "runcodec.h"
+#include "runfilter.h"
 
 #include <chkpt.h>
 #include <sm.h>
 #include <restart.h>
 #include <vol.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+
+#include <set>
+
 #define PARSE_LSN(a,b) \
     LogArchiver::ArchiveDirectory::parseLSN(a, b);
 
 
+BaseScanner::BaseScanner(const po::variables_map& options)
+    : options(options), fromLSN(lsn_t::null), toLSN(lsn_t::null),
+    fromTick(0), toTick(-1), limit(0), lsnOrdered(false),
+    scanEnd(lsn_t::null), cursorLSN(lsn_t::null), restrictFile(""),
+    scanDone(false), delivered(0), currentTick(0), perRecordDispatch(false)
+{
+    if (options.count("from-lsn")) {
+        fromLSN = parseLSNOption(options["from-lsn"].as<string>());
+    }
+    if (options.count("to-lsn")) {
+        toLSN = parseLSNOption(options["to-lsn"].as<string>());
+    }
+    if (options.count("from-tick")) {
+        fromTick = options["from-tick"].as<long>();
+    }
+    if (options.count("to-tick")) {
+        toTick = options["to-tick"].as<long>();
+    }
+    if (options.count("limit")) {
+        limit = options["limit"].as<size_t>();
+    }
+    if (options.count("cursor")) {
+        cursorFile = options["cursor"].as<string>();
+    }
+
+    lpid_t pidFrom = lpid_t::null;
+    lpid_t pidTo = lpid_t::null;
+    if (options.count("pid-from")) {
+        pidFrom = parsePIDOption(options["pid-from"].as<string>());
+    }
+    if (options.count("pid-to")) {
+        // given PID is inclusive
+        pidTo = parsePIDOption(options["pid-to"].as<string>());
+        if (pidTo != lpid_t::null) {
+            pidTo = lpid_t(pidTo.vol(), pidTo.store(), pidTo.page + 1);
+        }
+    }
+    if (pidFrom != lpid_t::null || pidTo != lpid_t::null) {
+        pidRanges.push_back(std::make_pair(pidFrom, pidTo));
+    }
+
+    if (options.count("pid-list")
+            && !options["pid-list"].as<string>().empty())
+    {
+        if (!pidRanges.empty()) {
+            throw runtime_error("--pid-list cannot be combined with "
+                    "--pid-from/--pid-to");
+        }
+
+        string fname = options["pid-list"].as<string>();
+        ifstream in(fname);
+        if (!in.good()) {
+            throw runtime_error("Could not open PID list file " + fname);
+        }
+
+        std::vector<lpid_t> pids;
+        string line;
+        while (getline(in, line)) {
+            if (!line.empty()) {
+                pids.push_back(parsePIDOption(line));
+            }
+        }
+        std::sort(pids.begin(), pids.end());
+
+        // consecutive pages of the same store are merged into one range
+        for (size_t i = 0; i < pids.size(); i++) {
+            lpid_t next(pids[i].vol(), pids[i].store(), pids[i].page + 1);
+            if (!pidRanges.empty() && pidRanges.back().second == pids[i]) {
+                pidRanges.back().second = next;
+            }
+            else if (pidRanges.empty() || pidRanges.back().second < next) {
+                pidRanges.push_back(std::make_pair(pids[i], next));
+            }
+        }
+    }
+
+    usePredicates = fromLSN != lsn_t::null || toLSN != lsn_t::null
+        || fromTick > 0 || toTick >= 0 || limit > 0 || !pidRanges.empty();
+}
+
+lpid_t BaseScanner::parsePIDOption(const string& str)
+{
+    if (str.empty()) {
+        return lpid_t::null;
+    }
+
+    unsigned vol = 0, store = 0, page = 0;
+    if (sscanf(str.c_str(), "%u.%u.%u", &vol, &store, &page) != 3) {
+        throw runtime_error("Invalid PID (expected <volume>.<store>.<page>): "
+                + str);
+    }
+    return lpid_t(vol, store, page);
+}
+
+bool BaseScanner::inPIDRanges(const lpid_t& pid) const
+{
+    // find first range which ends after the given PID
+    size_t lo = 0, hi = pidRanges.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const lpid_t& end = pidRanges[mid].second;
+        if (end != lpid_t::null && !(pid < end)) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+    return lo < pidRanges.size() && !(pid < pidRanges[lo].first);
+}
+
+lsn_t BaseScanner::parseLSNOption(const string& str)
+{
+    if (str.empty()) {
+        return lsn_t::null;
+    }
+
+    size_t dot = str.find('.');
+    if (dot == string::npos) {
+        throw runtime_error("Invalid LSN (expected <partition>.<offset>): "
+                + str);
+    }
+    uint32_t partition = strtoul(str.substr(0, dot).c_str(), NULL, 10);
+    uint64_t offset = strtoull(str.substr(dot + 1).c_str(), NULL, 10);
+    return lsn_t(partition, offset);
+}
+
+bool BaseScanner::checkPredicates(logrec_t* lr)
+{
+    if (scanDone) {
+        return false;
+    }
+
+    logrec_t::kind_t type = lr->type();
+    if (type == logrec_t::t_tick_sec || type == logrec_t::t_tick_msec) {
+        currentTick++;
+    }
+    if (currentTick < fromTick) {
+        return false;
+    }
+    if (toTick >= 0 && currentTick > toTick) {
+        scanDone = lsnOrdered;
+        return false;
+    }
+
+    lsn_t lsn = lr->lsn_ck();
+    if (lsn < fromLSN) {
+        return false;
+    }
+    // skip record at the end of the previous run, still not overwritten
+    if (type == logrec_t::t_skip && lsn == cursorLSN) {
+        return false;
+    }
+    if (toLSN != lsn_t::null && lsn >= toLSN) {
+        scanDone = lsnOrdered;
+        return false;
+    }
+
+    if (!pidRanges.empty() && (lr->null_pid() || !inPIDRanges(lr->pid()))) {
+        return false;
+    }
+
+    delivered++;
+    if (limit > 0 && delivered >= limit) {
+        scanDone = true;
+    }
+    return true;
+}
+
+void BaseScanner::before_run()
+{
+    basethread_t::before_run();
+    if (!cursorFile.empty()) {
+        loadCursor();
+    }
+    buildDispatchTable();
+}
+
+void BaseScanner::raiseFromLSN(lsn_t lsn)
+{
+    if (fromLSN < lsn) {
+        fromLSN = lsn;
+        usePredicates = true;
+    }
+}
+
+void BaseScanner::getHandlers(std::vector<Handler*>& handlers)
+{
+    std::vector<Handler*> all = any_handlers;
+    all.insert(all.end(), pid_handlers.begin(), pid_handlers.end());
+    all.insert(all.end(), transaction_handlers.begin(),
+            transaction_handlers.end());
+    for (size_t k = 0; k < type_handlers.size(); k++) {
+        all.insert(all.end(), type_handlers[k].begin(),
+                type_handlers[k].end());
+    }
+
+    for (size_t i = 0; i < all.size(); i++) {
+        if (std::find(handlers.begin(), handlers.end(), all[i])
+                == handlers.end())
+        {
+            handlers.push_back(all[i]);
+        }
+    }
+}
+
+/*
+ * Cursor file format (text):
+ *   lsn <partition>.<offset>
+ *   handlers <n>
+ * followed by n entries "handler <i> <length>", each followed by a line
+ * break and the given number of bytes of state. Handlers are identified by
+ * their position in the handler lists, so the same command line must be
+ * used on every run.
+ */
+void BaseScanner::loadCursor()
+{
+    ifstream in(cursorFile);
+    if (!in.good()) {
+        // first run
+        return;
+    }
+
+    string key, value;
+    in >> key >> value;
+    if (key != "lsn") {
+        throw runtime_error("Invalid cursor file " + cursorFile);
+    }
+    lsn_t lsn = parseLSNOption(value);
+    raiseFromLSN(lsn);
+    scanEnd = lsn;
+    cursorLSN = lsn;
+
+    std::vector<Handler*> handlers;
+    getHandlers(handlers);
+
+    size_t count = 0;
+    in >> key >> count;
+    if (key != "handlers" || count != handlers.size()) {
+        throw runtime_error("Cursor file " + cursorFile
+                + " does not match the handlers of this command");
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t index = 0, length = 0;
+        in >> key >> index >> length;
+        in.get(); // line break
+        if (key != "handler" || index != i) {
+            throw runtime_error("Invalid cursor file " + cursorFile);
+        }
+
+        string state(length, '\0');
+        in.read(&state[0], length);
+        if (!in.good()) {
+            throw runtime_error("Truncated cursor file " + cursorFile);
+        }
+        std::istringstream stateIn(state);
+        handlers[i]->loadState(stateIn);
+    }
+
+    cerr << "Resuming scan at LSN " << lsn << endl;
+}
+
+void BaseScanner::saveCursor()
+{
+    if (limit > 0 && delivered >= limit && !lsnOrdered) {
+        cerr << "Cursor not updated: scan stopped by limit and records "
+            << "were not delivered in LSN order" << endl;
+        return;
+    }
+
+    std::vector<Handler*> handlers;
+    getHandlers(handlers);
+
+    // write into a temporary file and rename, so that an interrupted run
+    // leaves the previous cursor intact
+    string tmpFile = cursorFile + ".tmp";
+    {
+        ofstream out(tmpFile, ios::trunc);
+        if (!out.good()) {
+            throw runtime_error("Could not write cursor file " + tmpFile);
+        }
+
+        out << "lsn " << scanEnd.hi() << "." << scanEnd.lo() << "\n";
+        out << "handlers " << handlers.size() << "\n";
+        for (size_t i = 0; i < handlers.size(); i++) {
+            std::ostringstream stateOut;
+            handlers[i]->saveState(stateOut);
+            string state = stateOut.str();
+            out << "handler " << i << " " << state.size() << "\n" << state;
+        }
+
+        if (!out.good()) {
+            throw runtime_error("Could not write cursor file " + tmpFile);
+        }
+    }
+
+    if (::rename(tmpFile.c_str(), cursorFile.c_str()) != 0) {
+        throw runtime_error("Could not rename cursor file " + tmpFile);
+    }
+}
+
+void BaseScanner::buildDispatchTable()
+{
+    typeDispatch.clear();
+    for (size_t k = 0; k < logrec_t::t_max_logrec; k++) {
+        typeOffsets[k] = typeDispatch.size();
+        if (k < type_handlers.size()) {
+            typeDispatch.insert(typeDispatch.end(),
+                    type_handlers[k].begin(), type_handlers[k].end());
+        }
+    }
+    typeOffsets[logrec_t::t_max_logrec] = typeDispatch.size();
+
+    std::set<Handler*> typeSet(typeDispatch.begin(), typeDispatch.end());
+    std::vector<std::set<Handler*>> lists;
+    lists.push_back(std::set<Handler*>(any_handlers.begin(),
+                any_handlers.end()));
+    lists.push_back(std::set<Handler*>(pid_handlers.begin(),
+                pid_handlers.end()));
+    lists.push_back(std::set<Handler*>(transaction_handlers.begin(),
+                transaction_handlers.end()));
+    lists.push_back(typeSet);
+
+    std::set<Handler*> seen;
+    perRecordDispatch = false;
+    for (size_t l = 0; l < lists.size(); l++) {
+        for (auto h : lists[l]) {
+            if (!seen.insert(h).second) {
+                perRecordDispatch = true;
+            }
+        }
+    }
+}
+
 void BaseScanner::handle(logrec_t* lr)
 {
-    logrec_t& r = *lr;
-    size_t i;
-    for (i=0; i < any_handlers.size(); i++)
-        any_handlers.at(i)->invoke(r);
-    if (!r.null_pid()){
-        for (i=0; i < pid_handlers.size(); i++)
-            pid_handlers.at(i)->invoke(r);
+    if (usePredicates && !checkPredicates(lr)) {
+        return;
     }
-    if (r.is_single_sys_xct() || r.tid() != tid_t::null){
-        for (i=0; i < transaction_handlers.size(); i++)
-            transaction_handlers.at(i)->invoke(r);
+    noteScanned(lr);
+    dispatch(*lr);
+}
+
+void BaseScanner::dispatch(logrec_t& r)
+{
+    size_t i, end;
+    for (i = 0, end = any_handlers.size(); i < end; i++) {
+        any_handlers[i]->invoke(r);
+    }
+    if (!pid_handlers.empty() && !r.null_pid()) {
+        for (i = 0, end = pid_handlers.size(); i < end; i++) {
+            pid_handlers[i]->invoke(r);
+        }
+    }
+    if (!transaction_handlers.empty() &&
+            (r.is_single_sys_xct() || r.tid() != tid_t::null))
+    {
+        for (i = 0, end = transaction_handlers.size(); i < end; i++) {
+            transaction_handlers[i]->invoke(r);
+        }
+    }
+    for (i = typeOffsets[r.type()], end = typeOffsets[r.type() + 1];
+            i < end; i++)
+    {
+        typeDispatch[i]->invoke(r);
+    }
+}
+
+void BaseScanner::handleBatch(logrec_t** recs, size_t n)
+{
+    size_t i, j, end;
+
+    if (usePredicates) {
+        // compact batch in place to the records that satisfy the predicates
+        for (i = 0, j = 0; j < n; j++) {
+            if (checkPredicates(recs[j])) { recs[i++] = recs[j]; }
+        }
+        n = i;
+    }
+    for (j = 0; j < n; j++) {
+        noteScanned(recs[j]);
+    }
+
+    if (perRecordDispatch) {
+        for (j = 0; j < n; j++) {
+            dispatch(*recs[j]);
+        }
+        return;
+    }
+
+    for (i = 0, end = any_handlers.size(); i < end; i++) {
+        any_handlers[i]->invokeBatch(recs, n);
+    }
+
+    if (!pid_handlers.empty()) {
+        pidBatch.clear();
+        for (j = 0; j < n; j++) {
+            if (!recs[j]->null_pid()) { pidBatch.push_back(recs[j]); }
+        }
+        for (i = 0, end = pid_handlers.size(); i < end; i++) {
+            pid_handlers[i]->invokeBatch(pidBatch.data(), pidBatch.size());
+        }
+    }
+
+    if (!transaction_handlers.empty()) {
+        xctBatch.clear();
+        for (j = 0; j < n; j++) {
+            if (recs[j]->is_single_sys_xct() || recs[j]->tid() != tid_t::null)
+            {
+                xctBatch.push_back(recs[j]);
+            }
+        }
+        for (i = 0, end = transaction_handlers.size(); i < end; i++) {
+            transaction_handlers[i]->invokeBatch(xctBatch.data(),
+                    xctBatch.size());
+        }
+    }
+
+    if (!typeDispatch.empty()) {
+        for (j = 0; j < n; j++) {
+            logrec_t::kind_t type = recs[j]->type();
+            for (i = typeOffsets[type], end = typeOffsets[type + 1];
+                    i < end; i++)
+            {
+                typeDispatch[i]->invoke(*recs[j]);
+            }
+        }
     }
-    for (i=0; type_handlers.size() > 0 && i < type_handlers.at(r.type()).size(); i++)
-        type_handlers.at(r.type()).at(i)->invoke(r);
 }
 
 void BaseScanner::finalize()
 {
+    if (!cursorFile.empty()) {
+        saveCursor();
+    }
+
     size_t i;
     for (i=0; i < any_handlers.size(); i++)
         any_handlers.at(i)->finalize();
@@ -46,15 +473,234 @@ void BaseScanner::finalize()
     }
 }
 
+void BaseScanner::handleBatch(char* begin, char* end)
+{
+    std::vector<logrec_t*> recs;
+    while (begin < end) {
+        recs.push_back((logrec_t*) begin);
+        begin += recs.back()->length();
+    }
+    handleBatch(recs.data(), recs.size());
+}
+
+void BaseScanner::consumeBatches(std::vector<LogrecBatchProducer*>& producers,
+        bool ordered, const std::vector<string>& segmentNames)
+{
+    char* begin = NULL;
+    char* end = NULL;
+    bool segmentEnd = false;
+
+    // a failed producer ends its output early, so the remaining ones
+    // must be stopped like when the scan is done
+    bool failed = false;
+
+    if (ordered) {
+        size_t segment = 0;
+        bool segmentStart = true;
+        while (true) {
+            LogrecBatchProducer* p = producers[segment % producers.size()];
+            if (segmentStart && openFileCallback
+                    && segment < segmentNames.size())
+            {
+                openFileCallback(segmentNames[segment].c_str());
+            }
+
+            // segments are assigned round-robin, so if the producer of the
+            // current segment is finished, so are all the others
+            if (!p->nextBatch(begin, end, segmentEnd)) {
+                failed = p->failed();
+                break;
+            }
+            handleBatch(begin, end);
+            p->releaseBatch();
+            if (isDone()) {
+                break;
+            }
+
+            segmentStart = segmentEnd;
+            if (segmentEnd) {
+                segment++;
+            }
+        }
+    }
+    else {
+        std::vector<LogrecBatchProducer*> active = producers;
+        size_t i = 0;
+        while (!active.empty()) {
+            i = i % active.size();
+            if (!active[i]->nextBatch(begin, end, segmentEnd)) {
+                if (active[i]->failed()) {
+                    failed = true;
+                    break;
+                }
+                active.erase(active.begin() + i);
+                continue;
+            }
+            handleBatch(begin, end);
+            active[i]->releaseBatch();
+            if (isDone()) {
+                break;
+            }
+            i++;
+        }
+    }
+
+    if (isDone() || failed) {
+        for (size_t i = 0; i < producers.size(); i++) {
+            producers[i]->stop();
+        }
+    }
+}
+
+LogrecBatchProducer::LogrecBatchProducer(size_t batchSize, size_t batchCount)
+    : smthread_t(t_regular, "LogrecBatchProducer"),
+    currentBatch(NULL), batchSize(batchSize)
+{
+    buffer = new AsyncRingBuffer(batchSize, batchCount);
+}
+
+LogrecBatchProducer::~LogrecBatchProducer()
+{
+    delete buffer;
+}
+
+void LogrecBatchProducer::run()
+{
+    try {
+        produce();
+        if (currentBatch) {
+            flushBatch(true);
+        }
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+    buffer->set_finished();
+}
+
+void LogrecBatchProducer::joinAll(std::vector<LogrecBatchProducer*>& producers)
+{
+    std::exception_ptr error;
+    for (size_t i = 0; i < producers.size(); i++) {
+        producers[i]->join();
+        if (!error) {
+            error = producers[i]->error;
+        }
+        delete producers[i];
+    }
+    producers.clear();
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+bool LogrecBatchProducer::append(logrec_t* lr)
+{
+    size_t length = lr->length();
+    BatchHeader* header = (BatchHeader*) currentBatch;
+
+    if (sizeof(BatchHeader) + length > batchSize) {
+        throw runtime_error("Log record of " + std::to_string(length)
+                + " bytes does not fit into a batch of "
+                + std::to_string(batchSize) + " bytes");
+    }
+
+    if (header && header->used + length > batchSize) {
+        flushBatch(false);
+        header = NULL;
+    }
+
+    if (!header) {
+        currentBatch = buffer->producerRequest();
+        if (!currentBatch) {
+            // consumer has shut down the buffer
+            return false;
+        }
+        header = (BatchHeader*) currentBatch;
+        header->used = sizeof(BatchHeader);
+        header->segmentEnd = false;
+    }
+
+    memcpy(currentBatch + header->used, lr, length);
+    header->used += length;
+
+    return true;
+}
+
+bool LogrecBatchProducer::endSegment()
+{
+    if (!currentBatch) {
+        // segment end is signaled with an empty batch
+        currentBatch = buffer->producerRequest();
+        if (!currentBatch) {
+            return false;
+        }
+        BatchHeader* header = (BatchHeader*) currentBatch;
+        header->used = sizeof(BatchHeader);
+    }
+    return flushBatch(true);
+}
+
+bool LogrecBatchProducer::flushBatch(bool segmentEnd)
+{
+    w_assert1(currentBatch);
+    BatchHeader* header = (BatchHeader*) currentBatch;
+    header->segmentEnd = segmentEnd;
+    buffer->producerRelease();
+    currentBatch = NULL;
+    return true;
+}
+
+bool LogrecBatchProducer::nextBatch(char*& begin, char*& end,
+        bool& segmentEnd)
+{
+    char* batch = buffer->consumerRequest();
+    if (!batch) {
+        return false;
+    }
+
+    BatchHeader* header = (BatchHeader*) batch;
+    begin = batch + sizeof(BatchHeader);
+    end = batch + header->used;
+    segmentEnd = header->segmentEnd;
+    return true;
+}
+
+void LogrecBatchProducer::releaseBatch()
+{
+    buffer->consumerRelease();
+}
+
+void LogrecBatchProducer::stop()
+{
+    buffer->set_finished();
+}
+
 BlockScanner::BlockScanner(const po::variables_map& options,
         bitset<logrec_t::t_max_logrec>* filter)
-    : BaseScanner(options), pnum(-1)
+    : BaseScanner(options)
 {
     logdir = options["logdir"].as<string>().c_str();
     blockSize = options["sm_archiver_block_size"].as<int>();
+    readAhead = options["readahead"].as<size_t>();
     logScanner = new LogScanner(blockSize);
-    currentBlock = new char[blockSize];
 
+    follow = options.count("follow") && options["follow"].as<bool>();
+    followFrom = lsn_t::null;
+    useFilter = filter != NULL;
+    indexer = NULL;
+    if (filter) {
+        this->filter = *filter;
+        indexer = new RecordIndexer(*filter);
+    }
+
+    setupFilter(logScanner, filter);
+}
+
+void BlockScanner::setupFilter(LogScanner* logScanner,
+        bitset<logrec_t::t_max_logrec>* filter)
+{
     if (filter) {
         logScanner->ignoreAll();
         for (int i = 0; i < logrec_t::t_max_logrec; i++) {
@@ -67,10 +713,10 @@ BlockScanner::BlockScanner(const po::variables_map& options,
     }
 }
 
-void BlockScanner::findFirstFile()
+void BlockScanner::listPartitions(const string& logdir,
+        std::vector<int>& pnums)
 {
-    pnum = numeric_limits<int>::max();
-    os_dir_t dir = os_opendir(logdir);
+    os_dir_t dir = os_opendir(logdir.c_str());
     if (!dir) {
         smlevel_0::errlog->clog << fatal_prio <<
             "Error: could not open recovery log dir: " <<
@@ -80,93 +726,737 @@ void BlockScanner::findFirstFile()
     os_dirent_t* entry = os_readdir(dir);
     const char * PREFIX = "log.";
 
+    std::vector<int> found;
     while (entry != NULL) {
         const char* fname = entry->d_name;
         if (strncmp(PREFIX, fname, strlen(PREFIX)) == 0) {
-            int p = atoi(fname + strlen(PREFIX));
-            if (p < pnum) {
-                pnum = p;
-            }
+            found.push_back(atoi(fname + strlen(PREFIX)));
         }
         entry = os_readdir(dir);
     }
-    os_closedir(dir);
+    os_closedir(dir);
+
+    // like getNextFile, stop at the first missing partition
+    std::sort(found.begin(), found.end());
+    for (size_t i = 0; i < found.size(); i++) {
+        if (i > 0 && found[i] != found[i-1] + 1) {
+            break;
+        }
+        pnums.push_back(found[i]);
+    }
+}
+
+void BlockScanner::listPartitionFiles(const string& logdir,
+        std::vector<string>& files, lsn_t from, lsn_t to)
+{
+    std::vector<int> pnums;
+    listPartitions(logdir, pnums);
+    for (size_t i = 0; i < pnums.size(); i++) {
+        // the partition number is the high part of the LSN
+        if (from != lsn_t::null && pnums[i] < (int) from.hi()) { continue; }
+        if (to != lsn_t::null && pnums[i] > (int) to.hi()) { break; }
+
+        stringstream fname;
+        fname << logdir << "/log." << pnums[i];
+        files.push_back(fname.str());
+    }
+}
+
+BlockPrefetcher::BlockPrefetcher(const std::vector<string>& files,
+        size_t blockSize, size_t depth, off_t startOffset)
+    : smthread_t(t_regular, "BlockPrefetcher"),
+    files(files), blockSize(blockSize), depth(depth < 2 ? 2 : depth),
+    startOffset(startOffset)
+{
+    buffer = new AsyncRingBuffer(sizeof(BlockHeader) + blockSize,
+            this->depth);
+}
+
+BlockPrefetcher::~BlockPrefetcher()
+{
+    delete buffer;
+}
+
+void BlockPrefetcher::run()
+{
+    try {
+        for (size_t i = 0; i < files.size(); i++) {
+            if (!readFile(i)) {
+                break;
+            }
+        }
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+    buffer->set_finished();
+}
+
+bool BlockPrefetcher::readFile(size_t fileIndex)
+{
+    const string& fname = files[fileIndex];
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Could not open log file " + fname);
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        ::close(fd);
+        throw runtime_error("Could not stat log file " + fname);
+    }
+    off_t fend = st.st_size;
+    off_t fpos = fileIndex == 0 ? startOffset : 0;
+
+    // we read the whole file sequentially, so let the kernel read ahead
+    // aggressively on its own as well
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    bool fileStart = true;
+    bool fileEnd = false;
+    while (!fileEnd) {
+        char* b = buffer->producerRequest();
+        if (!b) {
+            // consumer stopped scanning
+            ::close(fd);
+            return false;
+        }
+
+        BlockHeader* header = (BlockHeader*) b;
+        ssize_t bytesRead = 0;
+        if (fpos < fend) {
+            bytesRead = ::pread(fd, b + sizeof(BlockHeader), blockSize, fpos);
+            if (bytesRead < 0) {
+                ::close(fd);
+                throw runtime_error("IO error reading block from file");
+            }
+            fpos += bytesRead;
+        }
+
+        // ask for the block which will be requested once the ring is full
+        off_t ahead = fpos + (depth - 1) * blockSize;
+        if (ahead < fend) {
+            posix_fadvise(fd, ahead, blockSize, POSIX_FADV_WILLNEED);
+        }
+
+        fileEnd = bytesRead == 0 || fpos >= fend;
+        header->length = bytesRead;
+        header->fileIndex = fileIndex;
+        header->fileStart = fileStart;
+        header->fileEnd = fileEnd;
+        fileStart = false;
+
+        buffer->producerRelease();
+    }
+
+    ::close(fd);
+    return true;
+}
+
+char* BlockPrefetcher::next(BlockHeader*& header)
+{
+    char* b = buffer->consumerRequest();
+    if (!b) {
+        return NULL;
+    }
+    header = (BlockHeader*) b;
+    return b + sizeof(BlockHeader);
+}
+
+void BlockPrefetcher::release()
+{
+    buffer->consumerRelease();
+}
+
+void BlockPrefetcher::stop()
+{
+    buffer->set_finished();
+}
+
+void BlockScanner::run()
+{
+    std::vector<string> files;
+    off_t startOffset = 0;
+    if (restrictFile.empty()) {
+        listPartitionFiles(logdir, files, fromLSN, toLSN);
+        // seek directly to the first record of the range
+        if (!files.empty() && fromLSN != lsn_t::null) {
+            stringstream fname;
+            fname << logdir << "/log." << fromLSN.hi();
+            if (files[0] == fname.str()) {
+                startOffset = fromLSN.lo();
+            }
+        }
+    }
+    else {
+        ifstream in(restrictFile);
+        if (in.good()) {
+            files.push_back(restrictFile);
+        }
+    }
+
+    if (files.empty()) {
+        throw runtime_error("Could not find/open log files in "
+                + string(logdir));
+    }
+
+    lsnOrdered = true;
+    BlockPrefetcher* reader = new BlockPrefetcher(files, blockSize, readAhead,
+            startOffset);
+    reader->fork();
+
+    BlockPrefetcher::BlockHeader* header = NULL;
+    char* block = NULL;
+    bool skipFile = false;
+    size_t bpos = 0;
+    logrec_t* lr = NULL;
+    std::vector<logrec_t*> batch;
+
+    while ((block = reader->next(header))) {
+        if (header->fileStart) {
+            const char* fname = files[header->fileIndex].c_str();
+            if (openFileCallback) {
+                openFileCallback(fname);
+            }
+            cerr << "Scanning log file " << fname << endl;
+            skipFile = false;
+            if (indexer) {
+                indexer->reset();
+            }
+
+            // records cannot be recognized from an arbitrary offset, so
+            // the seek must land exactly on a record
+            if (startOffset > 0 && header->fileIndex == 0
+                    && header->length > 0)
+            {
+                logrec_t* first = (logrec_t*) block;
+                if (first->length() < sizeof(lsn_t)
+                        || first->length() > header->length
+                        || first->lsn_ck() != fromLSN)
+                {
+                    reader->release();
+                    reader->stop();
+                    reader->join();
+                    delete reader;
+                    stringstream msg;
+                    msg << "No log record begins at LSN " << fromLSN;
+                    throw runtime_error(msg.str());
+                }
+            }
+        }
+
+        // after a skip log record, the rest of the file is ignored
+        if (!skipFile && header->length > 0 && indexer) {
+            indexer->index(block, header->length, batch);
+            for (size_t i = 0; i < batch.size(); i++) {
+                if (batch[i]->type() == logrec_t::t_skip) {
+                    batch.resize(i + 1);
+                    skipFile = true;
+                    break;
+                }
+            }
+        }
+        else if (!skipFile && header->length > 0) {
+            bpos = 0;
+            while (logScanner->nextLogrec(block, bpos, lr)) {
+                batch.push_back(lr);
+                if (lr->type() == logrec_t::t_skip) {
+                    skipFile = true;
+                    break;
+                }
+            }
+        }
+
+        // remember where reading stopped, so that followLog does not pass
+        // records through the predicates twice; a skip record is where the
+        // log manager continues writing
+        if (!batch.empty()) {
+            lr = batch.back();
+            followFrom = lr->lsn_ck();
+            if (lr->type() != logrec_t::t_skip) {
+                followFrom = lsn_t(followFrom.hi(),
+                        followFrom.lo() + lr->length());
+            }
+        }
+
+        // records point into the block, so they must be handled before
+        // it is released
+        handleBatch(batch.data(), batch.size());
+        batch.clear();
+        reader->release();
+
+        if (isDone()) {
+            reader->stop();
+            break;
+        }
+    }
+
+    reader->join();
+    std::exception_ptr error = reader->getError();
+    delete reader;
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    if (follow && !isDone()) {
+        followLog(files.back());
+    }
+
+    BaseScanner::finalize();
+}
+
+BlockScanner::~BlockScanner()
+{
+    delete logScanner;
+    delete indexer;
+}
+
+RecordIndexer::RecordIndexer(const bitset<logrec_t::t_max_logrec>& filter)
+    : current(0)
+{
+    memset(accept, 0, sizeof(accept));
+    for (size_t i = 0; i < logrec_t::t_max_logrec; i++) {
+        accept[i] = filter.test(i) ? 1 : 0;
+    }
+    accept[logrec_t::t_skip] = 1;
+}
+
+void RecordIndexer::reset()
+{
+    carry[0].clear();
+    carry[1].clear();
+}
+
+void RecordIndexer::index(char* block, size_t length,
+        std::vector<logrec_t*>& out)
+{
+    size_t pos = 0;
+
+    // complete the record carried over from the previous block
+    std::vector<char>& prev = carry[current];
+    current = 1 - current;
+    carry[current].clear();
+    if (!prev.empty()) {
+        // the length field itself may be split
+        if (prev.size() < sizeof(uint16_t)) {
+            size_t missing = sizeof(uint16_t) - prev.size();
+            if (missing > length) { missing = length; }
+            prev.insert(prev.end(), block, block + missing);
+            pos = missing;
+        }
+        if (prev.size() >= sizeof(uint16_t)) {
+            size_t recLength = ((logrec_t*) prev.data())->length();
+            size_t missing = std::min(recLength - prev.size(), length - pos);
+            prev.insert(prev.end(), block + pos, block + pos + missing);
+            pos += missing;
+            if (prev.size() == recLength) {
+                logrec_t* lr = (logrec_t*) prev.data();
+                if (accept[lr->type()]) {
+                    out.push_back(lr);
+                }
+            }
+        }
+        if (pos == length) {
+            // record still incomplete (or block used up)
+            if (prev.size() < sizeof(uint16_t) ||
+                    prev.size() < ((logrec_t*) prev.data())->length())
+            {
+                carry[current].swap(prev);
+            }
+            return;
+        }
+    }
+
+    // pre-pass: offsets of accepted records; the offset of a rejected record
+    // is overwritten by the next one
+    if (offsets.size() < length / sizeof(uint16_t) + 1) {
+        offsets.resize(length / sizeof(uint16_t) + 1);
+    }
+    uint32_t* offs = offsets.data();
+    size_t count = 0;
+    while (pos + sizeof(uint16_t) <= length) {
+        size_t recLength = ((logrec_t*) (block + pos))->length();
+        if (recLength == 0 || pos + recLength > length) {
+            break;
+        }
+        offs[count] = pos;
+        count += accept[((logrec_t*) (block + pos))->type()];
+        pos += recLength;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        out.push_back((logrec_t*) (block + offs[i]));
+    }
+
+    // carry over the beginning of a record which continues in the next block
+    if (pos < length && (pos + sizeof(uint16_t) > length ||
+                ((logrec_t*) (block + pos))->length() > 0))
+    {
+        carry[current].assign(block + pos, block + length);
+    }
+}
+
+
+/*
+ * Returns the log record at the given position if it is fully contained in
+ * the buffer, or NULL otherwise. Used by scanners that walk over contiguous
+ * log records without going through LogScanner.
+ */
+static logrec_t* getLogrec(char* buf, size_t pos, size_t end)
+{
+    // record length is the first field of the log record header
+    if (pos + sizeof(uint16_t) > end) {
+        return NULL;
+    }
+    logrec_t* lr = (logrec_t*) (buf + pos);
+    if (lr->length() == 0 || pos + lr->length() > end) {
+        return NULL;
+    }
+    return lr;
+}
+
+static volatile sig_atomic_t followInterrupted = 0;
+
+static void followSignalHandler(int)
+{
+    followInterrupted = 1;
+}
+
+static bool nextPartitionExists(const string& dir, uint32_t partition)
+{
+    stringstream next;
+    next << dir << "/log." << partition + 1;
+    return ::access(next.str().c_str(), R_OK) == 0;
+}
+
+/*
+ * Tails the given partition file, which is assumed to be the newest one,
+ * delivering records as they are appended. Records are read directly from
+ * the file instead of going through LogScanner, since the last block of an
+ * active partition is incomplete. The log manager also ends each flush with
+ * a skip log record, which the next flush overwrites, so a skip record only
+ * ends the partition once the next partition exists; until then, we stay at
+ * the offset of the skip record and poll. Runs until the scan is
+ * done (e.g., due to --to-lsn or --limit) or until SIGINT/SIGTERM, after
+ * which handlers are finalized normally.
+ */
+void BlockScanner::followLog(const string& lastFile)
+{
+    const char* dot = strrchr(lastFile.c_str(), '.');
+    if (!dot) {
+        throw runtime_error("Cannot follow log file " + lastFile);
+    }
+    uint32_t partition = strtoul(dot + 1, NULL, 10);
+    string dir = lastFile.substr(0, lastFile.rfind('/'));
+
+    // resume where run() stopped reading if it is in this partition,
+    // otherwise at the beginning of the partition
+    size_t fpos = followFrom.hi() == partition ? followFrom.lo() : 0;
+
+    int ifd = inotify_init1(IN_NONBLOCK);
+    if (ifd < 0 || inotify_add_watch(ifd, dir.c_str(),
+                IN_MODIFY | IN_CREATE | IN_CLOSE_WRITE) < 0)
+    {
+        throw runtime_error("Could not watch log directory " + dir);
+    }
+
+    followInterrupted = 0;
+    signal(SIGINT, followSignalHandler);
+    signal(SIGTERM, followSignalHandler);
+
+    std::vector<char> buffer(blockSize);
+    std::vector<logrec_t*> batch;
+    size_t used = 0;
+    int fd = -1;
+    string fname;
+
+    cerr << "Following log partition " << partition << endl;
+
+    while (!isDone() && !followInterrupted) {
+        if (fd < 0) {
+            stringstream ss;
+            ss << dir << "/log." << partition;
+            fname = ss.str();
+            fd = ::open(fname.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw runtime_error("Could not open log file " + fname);
+            }
+            used = 0;
+            if (fpos == 0 && openFileCallback) {
+                openFileCallback(fname.c_str());
+            }
+        }
+
+        ssize_t n = ::pread(fd, buffer.data() + used, buffer.size() - used,
+                fpos + used);
+        if (n < 0) {
+            throw runtime_error("Error reading log file " + fname);
+        }
+        used += n;
+
+        // deliver all complete records in the buffer
+        bool partitionEnd = false;
+        bool atSkip = false;
+        size_t bpos = 0;
+        logrec_t* lr;
+        while ((lr = getLogrec(buffer.data(), bpos, used))) {
+            if (lr->type() == logrec_t::t_skip) {
+                partitionEnd = nextPartitionExists(dir, partition);
+                atSkip = !partitionEnd;
+                if (partitionEnd) { bpos += lr->length(); }
+                break;
+            }
+            bpos += lr->length();
+            if (!useFilter || filter.test(lr->type())) {
+                batch.push_back(lr);
+            }
+        }
+        handleBatch(batch.data(), batch.size());
+        batch.clear();
+
+        if (bpos == 0 && used == buffer.size()) {
+            throw runtime_error("Invalid log record in " + fname);
+        }
+        memmove(buffer.data(), buffer.data() + bpos, used - bpos);
+        used -= bpos;
+        fpos += bpos;
+
+        if (atSkip) {
+            // the skip record and whatever follows it will be overwritten,
+            // so they are read again from the file
+            used = 0;
+        }
+        else if (!partitionEnd && n == 0 && used == 0) {
+            // no skip record, but a newer partition also means rollover
+            partitionEnd = nextPartitionExists(dir, partition);
+        }
+
+        if (partitionEnd) {
+            ::close(fd);
+            fd = -1;
+            partition++;
+            fpos = 0;
+            cerr << "Following log partition " << partition << endl;
+            continue;
+        }
+
+        if (n == 0 || atSkip) {
+            // wait until something changes in the log directory; the
+            // timeout allows checking for interruption
+            struct pollfd pfd;
+            pfd.fd = ifd;
+            pfd.events = POLLIN;
+            if (::poll(&pfd, 1, 1000) > 0) {
+                char events[4096];
+                while (::read(ifd, events, sizeof(events)) > 0) {}
+            }
+        }
+    }
+
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    ::close(ifd);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+}
+
+MmapScanner::MmapScanner(const po::variables_map& options,
+        bitset<logrec_t::t_max_logrec>* filter)
+    : BaseScanner(options)
+{
+    logdir = options["logdir"].as<string>();
+    // drop pages behind the cursor in units of one archiver block, rounded
+    // up to whole pages, since madvise requires page-aligned ranges
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    dropWindow = options["sm_archiver_block_size"].as<int>();
+    dropWindow = std::max<size_t>(1, (dropWindow + pageSize - 1) / pageSize)
+        * pageSize;
+    if (filter) {
+        this->filter = *filter;
+        this->filter.set(logrec_t::t_skip);
+    }
+    else {
+        this->filter.set();
+    }
+}
+
+void MmapScanner::run()
+{
+    std::vector<string> files;
+    if (restrictFile.empty()) {
+        BlockScanner::listPartitionFiles(logdir, files, fromLSN, toLSN);
+    }
+    else {
+        files.push_back(restrictFile);
+    }
+
+    if (files.empty()) {
+        throw runtime_error("Could not find/open log files in " + logdir);
+    }
+
+    lsnOrdered = true;
+    for (size_t i = 0; i < files.size() && !isDone(); i++) {
+        if (openFileCallback) {
+            openFileCallback(files[i].c_str());
+        }
+        scanFile(files[i]);
+    }
+
+    BaseScanner::finalize();
 }
 
-string BlockScanner::getNextFile()
+void MmapScanner::scanFile(const string& fname)
 {
-    stringstream fname;
-    fname << logdir << "/";
-    if (pnum < 0) {
-        findFirstFile();
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Could not open log file " + fname);
     }
-    else {
-        pnum++;
+
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        ::close(fd);
+        throw runtime_error("Could not stat log file " + fname);
     }
-    fname << "log." << pnum;
+    size_t fend = st.st_size;
+
+    cerr << "Scanning log file " << fname << endl;
 
-    if (openFileCallback) {
-        openFileCallback(fname.str().c_str());
+    if (fend == 0) {
+        ::close(fd);
+        return;
     }
 
-    return fname.str();
-}
+    char* base = (char*) mmap(NULL, fend, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        ::close(fd);
+        throw runtime_error("Could not map log file " + fname);
+    }
+    madvise(base, fend, MADV_SEQUENTIAL);
 
-void BlockScanner::run()
-{
-    size_t bpos = 0;
-    streampos fpos = 0, fend = 0;
-    //long count = 0;
-    int firstPartition = pnum;
+    size_t pos = 0;
+    size_t dropped = 0;
     logrec_t* lr = NULL;
+    std::vector<logrec_t*> batch;
 
-    while (true) {
-        // open partition number pnum
-        string fname = restrictFile.empty() ? getNextFile() : restrictFile;
-        ifstream in(fname, ios::binary | ios::ate);
+    // seek directly to the first record of the range
+    stringstream first;
+    first << logdir << "/log." << fromLSN.hi();
+    if (fromLSN != lsn_t::null && fname == first.str()
+            && fromLSN.lo() < fend)
+    {
+        pos = fromLSN.lo();
+        dropped = (pos / dropWindow) * dropWindow;
 
-        // does the file exist?
-        if (!in.good()) {
-            in.close();
+        // records cannot be recognized from an arbitrary offset, so the
+        // seek must land exactly on a record
+        lr = getLogrec(base, pos, fend);
+        if (!lr || lr->length() < sizeof(lsn_t)
+                || lr->lsn_ck() != fromLSN)
+        {
+            munmap(base, fend);
+            ::close(fd);
+            stringstream msg;
+            msg << "No log record begins at LSN " << fromLSN;
+            throw runtime_error(msg.str());
+        }
+    }
+
+    while ((lr = getLogrec(base, pos, fend))) {
+        if (filter[lr->type()]) {
+            batch.push_back(lr);
+        }
+        if (lr->type() == logrec_t::t_skip) {
             break;
         }
+        pos += lr->length();
+
+        // handlers must be done with the records behind the cursor
+        size_t dropEnd = (pos / dropWindow) * dropWindow;
+        if (dropEnd > dropped) {
+            handleBatch(batch.data(), batch.size());
+            batch.clear();
+            if (isDone()) {
+                break;
+            }
+            madvise(base + dropped, dropEnd - dropped, MADV_DONTNEED);
+            posix_fadvise(fd, dropped, dropEnd - dropped,
+                    POSIX_FADV_DONTNEED);
+            dropped = dropEnd;
+        }
+    }
+    handleBatch(batch.data(), batch.size());
 
-        // file is opened at the end
-        fend = in.tellg();
-        fpos = 0;
+    munmap(base, fend);
+    ::close(fd);
+}
 
-        cerr << "Scanning log file " << fname << endl;
+class PartitionParser : public LogrecBatchProducer {
+public:
+    PartitionParser(const std::vector<string>& files, size_t blockSize,
+            bitset<logrec_t::t_max_logrec>* filter)
+        : LogrecBatchProducer(blockSize), files(files), blockSize(blockSize),
+        filter(filter)
+    {}
 
-        while (fpos < fend) {
-            //cerr << "Reading block at " << fpos << " from " << fname.str();
+    virtual ~PartitionParser() {}
+
+protected:
+    virtual void produce()
+    {
+        char* block = new char[blockSize];
+        for (size_t i = 0; i < files.size(); i++) {
+            if (!parsePartition(files[i], block) || !endSegment()) {
+                break;
+            }
+        }
+        delete[] block;
+    }
 
-            // read next block from partition file
+private:
+    std::vector<string> files;
+    size_t blockSize;
+    bitset<logrec_t::t_max_logrec>* filter;
+
+    bool parsePartition(const string& fname, char* block)
+    {
+        // a fresh scanner per partition, since partitions are not contiguous
+        LogScanner logScanner(blockSize);
+        BlockScanner::setupFilter(&logScanner, filter);
+
+        ifstream in(fname, ios::binary | ios::ate);
+        if (!in.good()) {
+            throw runtime_error("Could not open log file " + fname);
+        }
+        streampos fend = in.tellg();
+        streampos fpos = 0;
+        size_t bpos = 0;
+        logrec_t* lr = NULL;
+
+        while (fpos < fend) {
             in.seekg(fpos);
             if (in.fail()) {
                 throw runtime_error("IO error seeking into file");
             }
-            in.read(currentBlock, blockSize);
+            in.read(block, blockSize);
             if (in.eof()) {
-                // partial read on end of file
                 fpos = fend;
             }
             else if (in.gcount() == 0) {
-                // file ended exactly on block boundary
                 break;
             }
             else if (in.fail()) {
-                // EOF implies fail, so we check it first
                 throw runtime_error("IO error reading block from file");
             }
             else {
                 fpos += blockSize;
             }
 
-            //cerr << " - " << in.gcount() << " bytes OK" << endl;
-
             bpos = 0;
-            while (logScanner->nextLogrec(currentBlock, bpos, lr)) {
-                handle(lr);
+            while (logScanner.nextLogrec(block, bpos, lr)) {
+                if (!append(lr)) {
+                    return false;
+                }
                 if (lr->type() == logrec_t::t_skip) {
                     fpos = fend;
                     break;
@@ -174,112 +1464,594 @@ void BlockScanner::run()
             }
         }
 
-        in.close();
+        return true;
+    }
+};
 
-        if (!restrictFile.empty()) {
-            break;
-        }
+ParallelBlockScanner::ParallelBlockScanner(const po::variables_map& options,
+        bitset<logrec_t::t_max_logrec>* filter)
+    : BaseScanner(options), useFilter(filter != NULL)
+{
+    logdir = options["logdir"].as<string>();
+    blockSize = options["sm_archiver_block_size"].as<int>();
+    threads = options["threads"].as<size_t>();
+    ordered = !options["unordered"].as<bool>();
+    if (filter) {
+        this->filter = *filter;
+    }
+    if (threads == 0) {
+        threads = 1;
     }
+}
 
-    if (pnum == firstPartition && bpos == 0) {
-        throw runtime_error("Could not find/open log files in "
-                + string(logdir));
+void ParallelBlockScanner::run()
+{
+    std::vector<string> files;
+    if (restrictFile.empty()) {
+        BlockScanner::listPartitionFiles(logdir, files, fromLSN, toLSN);
+    }
+    else {
+        files.push_back(restrictFile);
+    }
+
+    if (files.empty()) {
+        throw runtime_error("Could not find/open log files in " + logdir);
+    }
+
+    // partitions are assigned round-robin to the workers
+    size_t workers = std::min(threads, files.size());
+    std::vector<std::vector<string>> assigned(workers);
+    for (size_t i = 0; i < files.size(); i++) {
+        assigned[i % workers].push_back(files[i]);
+    }
+
+    lsnOrdered = ordered;
+    cerr << "Scanning " << files.size() << " log files with "
+        << workers << " threads" << endl;
+
+    std::vector<LogrecBatchProducer*> producers;
+    for (size_t i = 0; i < workers; i++) {
+        producers.push_back(new PartitionParser(assigned[i], blockSize,
+                    useFilter ? &filter : NULL));
+        producers[i]->fork();
     }
 
+    consumeBatches(producers, ordered, files);
+
+    LogrecBatchProducer::joinAll(producers);
+
     BaseScanner::finalize();
 }
 
-BlockScanner::~BlockScanner()
+LogArchiveScanner::LogArchiveScanner(const po::variables_map& options)
+    : BaseScanner(options), compressed(false), directory(NULL), jobs(NULL),
+    nextJob(NULL)
 {
-    delete currentBlock;
-    delete logScanner;
+    archdir = options["logdir"].as<string>();
+    threads = options["threads"].as<size_t>();
+    if (threads == 0) {
+        threads = 1;
+    }
 }
 
+// Bytes read from compressed runs and their uncompressed size, over all
+// threads of a scan
+static std::atomic<size_t> compressedBytesRead(0);
+static std::atomic<size_t> rawBytesRead(0);
 
-LogArchiveScanner::LogArchiveScanner(const po::variables_map& options)
-    : BaseScanner(options), runBegin(lsn_t::null), runEnd(lsn_t::null)
+/*
+ * Like forEachInRun, for a compressed run. Blocks are decompressed one at a
+ * time and records outside the PID range of a probe are skipped.
+ */
+template <class F>
+static bool forEachInCompressedRun(const LogArchiveScanner::RunJob& job, F f)
 {
-    archdir = options["logdir"].as<string>();
+    CompressedRunReader reader(job.path);
+    std::vector<char> block;
+    bool completed = true;
+
+    size_t ranges = job.probes.empty() ? 1 : job.probes.size();
+    for (size_t j = 0; j < ranges && completed; j++) {
+        lpid_t firstPID = lpid_t::null;
+        lpid_t lastPID = lpid_t::null;
+        size_t b = 0;
+        if (!job.probes.empty()) {
+            firstPID = job.probes[j].pidBegin;
+            lastPID = job.probes[j].pidEnd;
+            if (firstPID != lpid_t::null) {
+                b = reader.findBlock(firstPID);
+            }
+        }
+
+        bool rangeDone = false;
+        for (; b < reader.getBlockCount() && !rangeDone && completed; b++) {
+            size_t length = reader.readBlock(b, block);
+            size_t pos = 0;
+            while (pos < length) {
+                logrec_t* lr = (logrec_t*) (block.data() + pos);
+                if (lr->length() == 0) { break; }
+                pos += lr->length();
+
+                if (firstPID != lpid_t::null && lr->pid() < firstPID) {
+                    continue;
+                }
+                if (lastPID != lpid_t::null && !(lr->pid() < lastPID)) {
+                    rangeDone = true;
+                    break;
+                }
+                w_assert1(lr->lsn_ck() >= job.begin);
+                w_assert1(lr->lsn_ck() < job.end);
+
+                if (!f(lr)) {
+                    completed = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    compressedBytesRead += reader.getBytesRead();
+    rawBytesRead += reader.getRawBytesRead();
+    return completed;
 }
 
-bool runCompare (string a, string b)
+/*
+ * Reads the records of a run, or only the blocks given by its probes, and
+ * passes them to f until f returns false. Returns false if stopped by f.
+ */
+template <class F>
+static bool forEachInRun(LogArchiver::ArchiveDirectory* directory,
+        const LogArchiveScanner::RunJob& job, F f)
 {
-    lsn_t lsn_a = PARSE_LSN(a.c_str(), false);
-    lsn_t lsn_b = PARSE_LSN(b.c_str(), false);
-    return lsn_a < lsn_b;
+    if (!job.path.empty()) {
+        return forEachInCompressedRun(job, f);
+    }
+
+    size_t ranges = job.probes.empty() ? 1 : job.probes.size();
+    for (size_t j = 0; j < ranges; j++) {
+        lpid_t firstPID = lpid_t::null;
+        lpid_t lastPID = lpid_t::null;
+        size_t offset = 0;
+        if (!job.probes.empty()) {
+            firstPID = job.probes[j].pidBegin;
+            lastPID = job.probes[j].pidEnd;
+            offset = job.probes[j].offset;
+        }
+
+        LogArchiver::ArchiveScanner::RunScanner rs(job.begin, job.end,
+                firstPID, lastPID, offset, directory);
+
+        lsn_t prevLSN = lsn_t::null;
+        lpid_t prevPid = lpid_t::null;
+
+        logrec_t* lr;
+        while (rs.next(lr)) {
+            w_assert1(lr->pid() >= prevPid);
+            w_assert1(lr->pid() != prevPid ||
+                    lr->page_prev_lsn() == lsn_t::null ||
+                    lr->page_prev_lsn() == prevLSN);
+            w_assert1(lr->lsn_ck() >= job.begin);
+            w_assert1(lr->lsn_ck() < job.end);
+
+            if (!f(lr)) {
+                return false;
+            }
+
+            prevLSN = lr->lsn_ck();
+            prevPid = lr->pid();
+        }
+    }
+    return true;
 }
 
+/*
+ * Reads the runs assigned to one worker when records are delivered on the
+ * scanner thread. Each run is one segment of the output.
+ */
+class RunReader : public LogrecBatchProducer {
+public:
+    RunReader(LogArchiver::ArchiveDirectory* directory,
+            const std::vector<LogArchiveScanner::RunJob>& runs,
+            size_t blockSize)
+        : LogrecBatchProducer(blockSize), directory(directory), runs(runs)
+    {}
+
+    virtual ~RunReader() {}
+
+protected:
+    virtual void produce()
+    {
+        for (size_t i = 0; i < runs.size(); i++) {
+            bool completed = forEachInRun(directory, runs[i],
+                    [this] (logrec_t* lr) { return append(lr); });
+            if (!completed || !endSegment()) {
+                break;
+            }
+        }
+    }
+
+private:
+    LogArchiver::ArchiveDirectory* directory;
+    std::vector<LogArchiveScanner::RunJob> runs;
+};
+
 void LogArchiveScanner::run()
 {
+    if (jobs) {
+        workerLoop();
+        return;
+    }
+
     size_t blockSize = options["sm_archiver_block_size"].as<int>();
-    LogArchiver::ArchiveDirectory* directory = new
-        LogArchiver::ArchiveDirectory(archdir, blockSize);
+    directory = new LogArchiver::ArchiveDirectory(archdir, blockSize);
 
-    std::vector<std::string> runFiles;
+    std::vector<RunJob> runs;
+    listRuns(runs);
+
+    if (threads > 1 && runs.size() > 1) {
+        if (limit > 0 || !scanWithClones(runs)) {
+            scanWithBatches(runs);
+        }
+    }
+    else {
+        for (size_t i = 0; i < runs.size() && !isDone(); i++) {
+            if (openFileCallback) {
+                openFileCallback(runs[i].fname.c_str());
+            }
+            scanRun(runs[i]);
+        }
+    }
 
+    BaseScanner::finalize();
+
+    if (compressed) {
+        size_t bytes = compressedBytesRead, rawBytes = rawBytesRead;
+        cerr << "Read " << bytes << " bytes of compressed runs for "
+            << rawBytes << " bytes of log records (compression ratio "
+            << (bytes > 0 ? (double) rawBytes / bytes : 0) << ")" << endl;
+    }
+
+    delete directory;
+    directory = NULL;
+}
+
+/*
+ * An archive may contain plain runs, compressed runs, or both versions of
+ * a run, since compression keeps the original (see RunCodec). Each run is
+ * read from its compressed version if there is one, which is less I/O, and
+ * as a plain run otherwise.
+ */
+void LogArchiveScanner::listRuns(std::vector<RunJob>& runs)
+{
+    std::vector<std::string> plainFiles;
+    std::vector<std::string> compressedFiles;
+    directory->listFiles(plainFiles);
+    RunCodec::listRuns(archdir, compressedFiles);
+    std::set<std::string> compressedRuns(compressedFiles.begin(),
+            compressedFiles.end());
+
+    std::vector<std::string> runFiles;
     if (restrictFile.empty()) {
-        directory->listFiles(runFiles);
+        runFiles = compressedFiles;
+        for (size_t i = 0; i < plainFiles.size(); i++) {
+            if (compressedRuns.count(plainFiles[i]) == 0) {
+                runFiles.push_back(plainFiles[i]);
+            }
+        }
         std::sort(runFiles.begin(), runFiles.end(), runCompare);
     }
     else {
         runFiles.push_back(restrictFile);
     }
 
-    runBegin = PARSE_LSN(runFiles[0].c_str(), false);
-    runEnd = PARSE_LSN(runFiles[0].c_str(), true);
-    std::vector<std::string>::const_iterator it;
+    /*
+     * With PID ranges, probe the archive index once per range to find the
+     * first block of each run which may contain the requested pages. Runs
+     * without any probe result are not read at all.
+     */
+    std::map<lsn_t, std::vector<ProbeResult>> runProbes;
+    if (!pidRanges.empty()) {
+        LogArchiver::ArchiveIndex* index = directory->getIndex();
+        for (size_t r = 0; r < pidRanges.size(); r++) {
+            std::vector<ProbeResult> probes;
+            index->probe(probes, pidRanges[r].first, pidRanges[r].second,
+                    fromLSN);
+            for (size_t j = 0; j < probes.size(); j++) {
+                runProbes[probes[j].runBegin].push_back(probes[j]);
+            }
+        }
+    }
+
+    lsn_t prevEnd = lsn_t::null;
+    size_t skipped = 0;
     for(size_t i = 0; i < runFiles.size(); i++) {
-        if (i > 0) {
-            // begin of run i must be equal to end of run i-1
-            runBegin = PARSE_LSN(runFiles[i].c_str(), false);
-            if (runBegin != runEnd) {
-                throw runtime_error("Hole found in run boundaries!");
+        RunJob job;
+        job.fname = runFiles[i];
+        job.begin = PARSE_LSN(runFiles[i].c_str(), false);
+        job.end = PARSE_LSN(runFiles[i].c_str(), true);
+
+        // begin of run i must be equal to end of run i-1
+        if (i > 0 && job.begin != prevEnd) {
+            throw runtime_error("Hole found in run boundaries!");
+        }
+        prevEnd = job.end;
+
+        // skip runs which do not overlap with the LSN range
+        if (toLSN != lsn_t::null && job.begin >= toLSN) {
+            break;
+        }
+        if (fromLSN != lsn_t::null && job.end <= fromLSN) {
+            continue;
+        }
+
+        if (compressedRuns.count(job.fname) > 0) {
+            job.path = archdir + "/" + RunCodec::PREFIX + job.fname;
+            addCompressedProbes(job);
+            compressed = true;
+        }
+        else if (!pidRanges.empty()) {
+            if (runProbes.count(job.begin) == 0) {
+                continue;
             }
-            runEnd = PARSE_LSN(runFiles[i].c_str(), true);
+            job.probes = runProbes[job.begin];
         }
 
-        if (openFileCallback) {
-            openFileCallback(runFiles[i].c_str());
+        if (!job.probes.empty() && !filterProbes(job)) {
+            skipped++;
+            continue;
+        }
+
+        runs.push_back(job);
+    }
+
+    if (skipped > 0) {
+        cerr << "Skipped " << skipped << " runs without records of the "
+            << "requested pages according to their filters" << endl;
+    }
+}
+
+/*
+ * Drops the probes of a run whose PID range is not in the run according to
+ * its filter, if it has one. Returns false if no probe is left, i.e., if the
+ * run does not have to be read at all.
+ */
+bool LogArchiveScanner::filterProbes(RunJob& job)
+{
+    RunFilter filter;
+    if (!filter.load(archdir + "/" + RunFilter::PREFIX + job.fname)) {
+        return true;
+    }
+
+    std::vector<ProbeResult> probes;
+    for (size_t i = 0; i < job.probes.size(); i++) {
+        if (filter.mayContainRange(job.probes[i].pidBegin,
+                    job.probes[i].pidEnd))
+        {
+            probes.push_back(job.probes[i]);
+        }
+    }
+    job.probes.swap(probes);
+    return !job.probes.empty();
+}
+
+/*
+ * Compressed runs are not in the archive index, so each PID range is probed
+ * with the block table of the run instead.
+ */
+void LogArchiveScanner::addCompressedProbes(RunJob& job)
+{
+    if (pidRanges.empty()) { return; }
+
+    CompressedRunReader reader(job.path);
+    for (size_t r = 0; r < pidRanges.size(); r++) {
+        ProbeResult probe;
+        probe.pidBegin = pidRanges[r].first;
+        probe.pidEnd = pidRanges[r].second;
+        probe.runBegin = job.begin;
+        probe.runEnd = job.end;
+        size_t b = probe.pidBegin == lpid_t::null ? 0 :
+            reader.findBlock(probe.pidBegin);
+        probe.offset = reader.getBlockCount() > 0 ?
+            reader.getBlock(b).rawOffset : 0;
+        job.probes.push_back(probe);
+    }
+}
+
+void LogArchiveScanner::scanRun(const RunJob& job)
+{
+    forEachInRun(directory, job, [this] (logrec_t* lr) {
+        handle(lr);
+        return !isDone();
+    });
+}
+
+bool LogArchiveScanner::cloneHandlers(LogArchiveScanner* worker)
+{
+    std::map<Handler*, Handler*> cloneOf;
+    bool cloned = true;
+
+    auto cloneAll = [&] (const std::vector<Handler*>& src,
+            std::vector<Handler*>& dst)
+    {
+        for (size_t i = 0; i < src.size(); i++) {
+            if (cloneOf.count(src[i]) == 0) {
+                Handler* c = src[i]->clone();
+                cloneOf[src[i]] = c;
+                if (c) {
+                    worker->clones.push_back(std::make_pair(src[i], c));
+                }
+            }
+            cloned = cloned && cloneOf[src[i]] != NULL;
+            dst.push_back(cloneOf[src[i]]);
+        }
+    };
+
+    cloneAll(any_handlers, worker->any_handlers);
+    cloneAll(pid_handlers, worker->pid_handlers);
+    cloneAll(transaction_handlers, worker->transaction_handlers);
+    worker->type_handlers.resize(type_handlers.size());
+    for (size_t k = 0; k < type_handlers.size(); k++) {
+        cloneAll(type_handlers[k], worker->type_handlers[k]);
+    }
+
+    if (!cloned) {
+        for (size_t i = 0; i < worker->clones.size(); i++) {
+            delete worker->clones[i].second;
+        }
+        worker->clones.clear();
+    }
+    return cloned;
+}
+
+bool LogArchiveScanner::scanWithClones(std::vector<RunJob>& runs)
+{
+    size_t workers = std::min(threads, runs.size());
+    std::atomic<size_t> next(0);
+
+    std::vector<LogArchiveScanner*> scanners;
+    for (size_t i = 0; i < workers; i++) {
+        LogArchiveScanner* w = new LogArchiveScanner(options);
+        if (!cloneHandlers(w)) {
+            // handlers are either all clonable or not, so this is the first
+            w_assert0(scanners.empty());
+            delete w;
+            return false;
+        }
+        // only this scanner loads and saves the cursor
+        w->cursorFile.clear();
+        w->raiseFromLSN(fromLSN);
+        w->directory = directory;
+        w->jobs = &runs;
+        w->nextJob = &next;
+        scanners.push_back(w);
+    }
+
+    cerr << "Scanning " << runs.size() << " runs with " << workers
+        << " threads" << endl;
+
+    for (size_t i = 0; i < workers; i++) {
+        scanners[i]->fork();
+    }
+    for (size_t i = 0; i < workers; i++) {
+        scanners[i]->join();
+        if (scanEnd < scanners[i]->scanEnd) {
+            scanEnd = scanners[i]->scanEnd;
+        }
+        for (size_t j = 0; j < scanners[i]->clones.size(); j++) {
+            scanners[i]->clones[j].first->merge(
+                    scanners[i]->clones[j].second);
+            delete scanners[i]->clones[j].second;
+        }
+        delete scanners[i];
+    }
+
+    return true;
+}
+
+void LogArchiveScanner::workerLoop()
+{
+    while (!isDone()) {
+        size_t j = nextJob->fetch_add(1);
+        if (j >= jobs->size()) {
+            break;
         }
 
-        LogArchiver::ArchiveScanner::RunScanner* rs =
-            new LogArchiver::ArchiveScanner::RunScanner(
-                    runBegin,
-                    runEnd,
-                    lpid_t::null, // first PID
-                    lpid_t::null, // last PID
-                    0,            // file offset
-                    directory
-            );
+        const RunJob& job = (*jobs)[j];
+        for (size_t i = 0; i < clones.size(); i++) {
+            clones[i].second->newFile(job.fname.c_str());
+        }
+        scanRun(job);
+    }
+}
+
+void LogArchiveScanner::scanWithBatches(std::vector<RunJob>& runs)
+{
+    size_t blockSize = options["sm_archiver_block_size"].as<int>();
+    size_t workers = std::min(threads, runs.size());
+
+    // runs are assigned round-robin and delivered in run order
+    std::vector<std::vector<RunJob>> assigned(workers);
+    std::vector<string> names;
+    for (size_t i = 0; i < runs.size(); i++) {
+        assigned[i % workers].push_back(runs[i]);
+        names.push_back(runs[i].fname);
+    }
+
+    cerr << "Reading " << runs.size() << " runs with " << workers
+        << " threads" << endl;
+
+    std::vector<LogrecBatchProducer*> producers;
+    for (size_t i = 0; i < workers; i++) {
+        producers.push_back(new RunReader(directory, assigned[i], blockSize));
+        producers[i]->fork();
+    }
+
+    consumeBatches(producers, true, names);
 
+    LogrecBatchProducer::joinAll(producers);
+}
+
+/*
+ * Merges the archive runs restricted to the PID range [begin, end), where a
+ * null PID means an open bound. Since runs are sorted by PID, the output of
+ * consecutive ranges concatenated is the same as a merge of the whole
+ * archive.
+ */
+class RangeMerger : public LogrecBatchProducer {
+public:
+    RangeMerger(LogArchiver::ArchiveDirectory* directory, lpid_t begin,
+            lpid_t end, lsn_t startLSN, size_t blockSize)
+        : LogrecBatchProducer(blockSize), directory(directory),
+        begin(begin), end(end), startLSN(startLSN), blockSize(blockSize)
+    {}
+
+    virtual ~RangeMerger() {}
+
+protected:
+    virtual void produce()
+    {
+        LogArchiver::ArchiveScanner logScan(directory);
+        LogArchiver::ArchiveScanner::RunMerger* merger =
+            logScan.open(begin, end, startLSN, blockSize);
+
+        logrec_t* lr;
         lsn_t prevLSN = lsn_t::null;
         lpid_t prevPid = lpid_t::null;
 
-        logrec_t* lr;
-        while (rs->next(lr)) {
+        while (merger && merger->next(lr)) {
             w_assert1(lr->pid() >= prevPid);
             w_assert1(lr->pid() != prevPid ||
                     lr->page_prev_lsn() == lsn_t::null ||
                     lr->page_prev_lsn() == prevLSN);
-            w_assert1(lr->lsn_ck() >= runBegin);
-            w_assert1(lr->lsn_ck() < runEnd);
+            w_assert1(begin == lpid_t::null || lr->pid() >= begin);
+            w_assert1(end == lpid_t::null || lr->pid() < end);
 
-            handle(lr);
+            if (!append(lr)) {
+                break;
+            }
 
             prevLSN = lr->lsn_ck();
             prevPid = lr->pid();
-        };
+        }
 
-        delete rs;
+        delete merger;
+        endSegment();
     }
 
-    BaseScanner::finalize();
-}
+private:
+    LogArchiver::ArchiveDirectory* directory;
+    lpid_t begin;
+    lpid_t end;
+    lsn_t startLSN;
+    size_t blockSize;
+};
 
 MergeScanner::MergeScanner(const po::variables_map& options)
     : BaseScanner(options)
 {
     archdir = options["logdir"].as<string>();
+    threads = options["threads"].as<size_t>();
+    ordered = !options["unordered"].as<bool>();
 }
 
 void MergeScanner::run()
@@ -290,26 +2062,68 @@ void MergeScanner::run()
 
     LogArchiver::ArchiveDirectory* directory = new
         LogArchiver::ArchiveDirectory(archdir, blockSize, bucketSize);
+
+    if (threads > 1 && pidRanges.empty()) {
+        // one merger per PID range, delivered in PID order unless unordered
+        std::vector<lpid_t> splits;
+        IndexInspector::getPIDSplits(directory->getIndex(), threads, splits);
+        splits.insert(splits.begin(), lpid_t::null);
+        splits.push_back(lpid_t::null);
+
+        cerr << "Merging log archive in " << splits.size() - 1
+            << " PID ranges" << endl;
+
+        std::vector<LogrecBatchProducer*> producers;
+        for (size_t i = 0; i < splits.size() - 1; i++) {
+            producers.push_back(new RangeMerger(directory, splits[i],
+                        splits[i+1], fromLSN, blockSize));
+            producers[i]->fork();
+        }
+
+        consumeBatches(producers, ordered);
+
+        LogrecBatchProducer::joinAll(producers);
+
+        BaseScanner::finalize();
+        return;
+    }
+
     LogArchiver::ArchiveScanner logScan(directory);
 
-    LogArchiver::ArchiveScanner::RunMerger* merger =
-        logScan.open(lpid_t::null, lpid_t::null, lsn_t::null, blockSize);
+    // without PID ranges, merge the whole PID domain
+    std::vector<std::pair<lpid_t, lpid_t>> ranges = pidRanges;
+    if (ranges.empty()) {
+        ranges.push_back(std::make_pair(lpid_t::null, lpid_t::null));
+    }
+
+    for (size_t r = 0; r < ranges.size() && !isDone(); r++) {
+        // the archive index skips runs which end before the LSN range and
+        // blocks which precede the PID range
+        LogArchiver::ArchiveScanner::RunMerger* merger =
+            logScan.open(ranges[r].first, ranges[r].second, fromLSN,
+                    blockSize);
+
+        logrec_t* lr;
 
-    logrec_t* lr;
+        lsn_t prevLSN = lsn_t::null;
+        lpid_t prevPid = lpid_t::null;
 
-    lsn_t prevLSN = lsn_t::null;
-    lpid_t prevPid = lpid_t::null;
+        while (merger && merger->next(lr)) {
+            w_assert1(lr->pid() >= prevPid);
+            w_assert1(lr->pid() != prevPid ||
+                    lr->page_prev_lsn() == lsn_t::null ||
+                    lr->page_prev_lsn() == prevLSN);
 
-    while (merger && merger->next(lr)) {
-        w_assert1(lr->pid() >= prevPid);
-        w_assert1(lr->pid() != prevPid ||
-                lr->page_prev_lsn() == lsn_t::null ||
-                lr->page_prev_lsn() == prevLSN);
+            handle(lr);
+            if (isDone()) {
+                break;
+            }
 
-        handle(lr);
+            prevLSN = lr->lsn_ck();
+            prevPid = lr->pid();
+        }
 
-        prevLSN = lr->lsn_ck();
-        prevPid = lr->pid();
+        delete merger;
     }
 
     BaseScanner::finalize();
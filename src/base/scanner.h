@@ -8,28 +8,95 @@
 
 #include "basethread.h"
 #include "handler.h"
+#include "ringbuffer.h"
 
+#include <atomic>
 #include <bitset>
+#include <exception>
 #include <functional>
 #include <boost/program_options.hpp>
 
 namespace po = boost::program_options;
 
+class LogrecBatchProducer;
+
 class BaseScanner : public basethread_t {
 public:
-    BaseScanner(const po::variables_map& options)
-        : options(options), restrictFile("")
-    {}
+    BaseScanner(const po::variables_map& options);
 
     virtual ~BaseScanner()
     {} // TODO do we need to delete the handlers here?
 
     void setRestrictFile(string fname) { restrictFile = fname; }
+
+    // Parses an LSN given as "<partition>.<offset>"
+    static lsn_t parseLSNOption(const string& str);
+    // Parses a page ID given as "<volume>.<store>.<page>"
+    static lpid_t parsePIDOption(const string& str);
 protected:
     virtual void handle(logrec_t* lr);
     virtual void finalize();
+    virtual void before_run();
     po::variables_map options;
 
+    // Dispatches a batch of records, e.g., all records of a block
+    void handleBatch(logrec_t** recs, size_t n);
+
+    /*
+     * Scan range and record limit given in the options. Records outside the
+     * range are not delivered to the handlers. Ticks are counted from the
+     * beginning of the scan. Once the limit is reached, or when the upper
+     * bound is crossed by a scanner which produces records in LSN order
+     * (see lsnOrdered), the scan is done and scanners should stop early.
+     */
+    lsn_t fromLSN;
+    lsn_t toLSN;
+    long fromTick;
+    long toTick;
+    size_t limit;
+    bool lsnOrdered;
+
+    /*
+     * PID ranges [first, second) given with --pid-from/--pid-to or
+     * --pid-list, sorted and disjoint. A null second PID means an open
+     * bound. Records outside these ranges are not delivered.
+     */
+    std::vector<std::pair<lpid_t, lpid_t>> pidRanges;
+
+    /*
+     * File which persists the position after the last delivered record (or
+     * of a trailing skip record) and the handler states between runs
+     * (--cursor). If it exists, the scan starts at the saved position. Only
+     * written if no record was skipped, i.e., unless a limit stopped a scan
+     * that is not in LSN order.
+     */
+    string cursorFile;
+    lsn_t scanEnd;
+    // position loaded from the cursor file, null on the first run
+    lsn_t cursorLSN;
+
+    // Raises the lower LSN bound of the scan
+    void raiseFromLSN(lsn_t lsn);
+
+    bool hasPredicates() const { return usePredicates; }
+    bool isDone() const { return scanDone; }
+    bool checkPredicates(logrec_t* lr);
+    bool inPIDRanges(const lpid_t& pid) const;
+
+    /*
+     * Delivers the batches of the given producers to the handlers. Producer i
+     * is responsible for segments i, i + n, i + 2n, ... of the input. In
+     * ordered mode, segments are delivered in that global order; otherwise
+     * producers are drained round-robin as their batches become available,
+     * which is only correct for handlers that do not depend on record order.
+     * If segment names are given, openFileCallback is invoked at the
+     * beginning of each segment (ordered mode only).
+     */
+    void consumeBatches(std::vector<LogrecBatchProducer*>& producers,
+            bool ordered,
+            const std::vector<string>& segmentNames = std::vector<string>());
+    void handleBatch(char* begin, char* end);
+
 public: // TODO make protected and add register methods
     std::vector<Handler*> any_handlers;
     std::vector<Handler*> pid_handlers;
@@ -39,6 +106,122 @@ public: // TODO make protected and add register methods
 
 protected:
     string restrictFile;
+
+private:
+    bool usePredicates;
+    bool scanDone;
+    size_t delivered;
+    long currentTick;
+
+    void getHandlers(std::vector<Handler*>& handlers);
+    void loadCursor();
+    void saveCursor();
+
+    /*
+     * A skip log record ends every flush of the active partition and is
+     * overwritten by the next flush, so the scan position stops at the skip
+     * record instead of moving past it. A scan resumed there does not
+     * deliver the skip record again (see cursorLSN).
+     */
+    void noteScanned(logrec_t* lr)
+    {
+        lsn_t lsn = lr->lsn_ck();
+        lsn_t next(lsn.hi(), lsn.lo() + lr->length());
+        if (lr->type() == logrec_t::t_skip) { next = lsn; }
+        if (scanEnd < next) { scanEnd = next; }
+    }
+
+    /*
+     * Type handlers flattened into a single array, computed once before
+     * run() by buildDispatchTable(). Handlers of kind k are those between
+     * typeDispatch[typeOffsets[k]] and typeDispatch[typeOffsets[k+1]].
+     */
+    std::vector<Handler*> typeDispatch;
+    size_t typeOffsets[logrec_t::t_max_logrec + 1];
+
+    // Scratch space for the sub-batches of pid and transaction handlers
+    std::vector<logrec_t*> pidBatch;
+    std::vector<logrec_t*> xctBatch;
+
+    /*
+     * Set if a handler is registered in more than one of the any, pid,
+     * transaction and type lists. Batches are then dispatched record by
+     * record, so that such a handler still sees records in log order.
+     */
+    bool perRecordDispatch;
+
+    void buildDispatchTable();
+    void dispatch(logrec_t& r);
+};
+
+/*
+ * Reads the given files sequentially on a background thread into the blocks
+ * of an AsyncRingBuffer, so that I/O overlaps with log record decoding in
+ * the consumer. Up to "depth" blocks are in flight at any time. Each block is
+ * preceded by a BlockHeader; the last block of a file may be partial. The
+ * first file is read from the given offset, which must be a log record
+ * boundary. An I/O error ends the output and is kept for the consumer,
+ * which rethrows it after join().
+ */
+class BlockPrefetcher : public smthread_t {
+public:
+    struct BlockHeader {
+        size_t length;
+        size_t fileIndex;
+        bool fileStart;
+        bool fileEnd;
+    };
+
+    BlockPrefetcher(const std::vector<string>& files, size_t blockSize,
+            size_t depth = 2, off_t startOffset = 0);
+    virtual ~BlockPrefetcher();
+
+    virtual void run();
+
+    // Consumer side -- returns NULL once all files were read
+    char* next(BlockHeader*& header);
+    void release();
+    // Stops reading early; blocked producer requests return
+    void stop();
+    std::exception_ptr getError() const { return error; }
+
+private:
+    std::vector<string> files;
+    size_t blockSize;
+    size_t depth;
+    off_t startOffset;
+    AsyncRingBuffer* buffer;
+    std::exception_ptr error;
+
+    bool readFile(size_t fileIndex);
+};
+
+/*
+ * Splits the blocks of a log partition into log records with a pre-pass
+ * over the record headers, which only reads the length and type of each
+ * record and appends its offset to the output if its type is accepted by
+ * the filter. The acceptance test is a table lookup added to the output
+ * count, so the loop has no data-dependent branches other than the block
+ * end. Records which span two blocks are reassembled in a carry buffer.
+ * Skip log records are always accepted, since they mark the end of a
+ * partition.
+ */
+class RecordIndexer {
+public:
+    RecordIndexer(const bitset<logrec_t::t_max_logrec>& filter);
+
+    // Appends the accepted records of the next block of the partition.
+    // Records stay valid until the following call.
+    void index(char* block, size_t length, std::vector<logrec_t*>& out);
+
+    // Called at the beginning of each partition
+    void reset();
+
+private:
+    uint8_t accept[256];
+    std::vector<char> carry[2];
+    size_t current;
+    std::vector<uint32_t> offsets;
 };
 
 class BlockScanner : public BaseScanner {
@@ -50,28 +233,168 @@ public:
     virtual void run();
 private:
     LogScanner* logScanner;
-    char* currentBlock;
     const char* logdir;
     size_t blockSize;
-    int pnum;
+    size_t readAhead;
+
+    // --follow: keep tailing the newest partition once the end is reached,
+    // starting after the last record read by run()
+    bool follow;
+    lsn_t followFrom;
+    bitset<logrec_t::t_max_logrec> filter;
+    bool useFilter;
 
-    void findFirstFile();
-    string getNextFile();
+    // with a filter, used instead of logScanner
+    RecordIndexer* indexer;
+
+    void followLog(const string& lastFile);
+
+public:
+    static void listPartitions(const string& logdir, std::vector<int>& pnums);
+    static void listPartitionFiles(const string& logdir,
+            std::vector<string>& files, lsn_t from = lsn_t::null,
+            lsn_t to = lsn_t::null);
+    static void setupFilter(LogScanner* logScanner,
+            bitset<logrec_t::t_max_logrec>* filter);
+};
+
+/*
+ * Zero-copy alternative to BlockScanner for read-only inspection. Each
+ * partition is mapped into memory and handlers get pointers directly into
+ * the mapping, which means they must not modify the log records. Pages
+ * behind the cursor are dropped from the mapping and the page cache.
+ */
+class MmapScanner : public BaseScanner {
+public:
+    MmapScanner(const po::variables_map& options,
+            bitset<logrec_t::t_max_logrec>* filter = NULL);
+    virtual ~MmapScanner() {};
+
+    virtual void run();
+private:
+    string logdir;
+    size_t dropWindow;
+    bitset<logrec_t::t_max_logrec> filter;
+
+    void scanFile(const string& fname);
+};
+
+/*
+ * Decodes log records on a separate thread and hands them over to the
+ * scanner thread in batches. Records are copied into the blocks of an
+ * AsyncRingBuffer, each of which starts with a BatchHeader. A batch never
+ * spans two segments (e.g., two log partitions), so that a consumer can
+ * restore the global order among several producers. An exception thrown by
+ * the producer ends its output and is rethrown on the consumer by joinAll.
+ */
+class LogrecBatchProducer : public smthread_t {
+public:
+    struct BatchHeader {
+        size_t used;
+        bool segmentEnd;
+    };
+
+    LogrecBatchProducer(size_t batchSize, size_t batchCount = 2);
+    virtual ~LogrecBatchProducer();
+
+    virtual void run();
+
+    // Consumer side -- returns false once the producer is finished
+    bool nextBatch(char*& begin, char*& end, bool& segmentEnd);
+    void releaseBatch();
+    void stop();
+    bool failed() const { return error != nullptr; }
+
+    // Joins and deletes the producers, then rethrows the first exception
+    // thrown by any of them
+    static void joinAll(std::vector<LogrecBatchProducer*>& producers);
+
+protected:
+    // Implemented by subclasses; calls append() and endSegment()
+    virtual void produce() = 0;
+
+    bool append(logrec_t* lr);
+    bool endSegment();
+
+private:
+    AsyncRingBuffer* buffer;
+    char* currentBatch;
+    size_t batchSize;
+    std::exception_ptr error;
+
+    bool flushBatch(bool segmentEnd);
+};
+
+/*
+ * Variant of BlockScanner which scans log partitions in parallel. Worker i
+ * scans partitions i, i + n, i + 2n, ..., with n being the number of
+ * threads. Records are delivered to the handlers in the scanner thread, so
+ * handlers need not be thread-safe.
+ */
+class ParallelBlockScanner : public BaseScanner {
+public:
+    ParallelBlockScanner(const po::variables_map& options,
+            bitset<logrec_t::t_max_logrec>* filter = NULL);
+    virtual ~ParallelBlockScanner() {};
+
+    virtual void run();
+private:
+    string logdir;
+    size_t blockSize;
+    size_t threads;
+    bool ordered;
+    bitset<logrec_t::t_max_logrec> filter;
+    bool useFilter;
 };
 
+/*
+ * Scans the log archive run by run. With --threads, runs are scanned
+ * concurrently. If all handlers can be cloned (see Handler::clone) and no
+ * record limit is given, each worker thread delivers records to its own
+ * clones, which are merged into the original handlers at the end; per-run
+ * notifications then go to Handler::newFile of the clones instead of
+ * openFileCallback. Otherwise, workers only read the runs and records are
+ * delivered in run order on the scanner thread.
+ */
 class LogArchiveScanner : public BaseScanner {
 public:
+    typedef LogArchiver::ArchiveIndex::ProbeResult ProbeResult;
+
+    struct RunJob {
+        string fname;
+        lsn_t begin;
+        lsn_t end;
+        // blocks to read with PID ranges; whole run if empty
+        std::vector<ProbeResult> probes;
+        // file of a compressed run; empty if read via the archive directory
+        string path;
+    };
+
     LogArchiveScanner(const po::variables_map& options);
     virtual ~LogArchiveScanner() {};
 
     virtual void run();
 private:
     string archdir;
-    lsn_t runBegin;
-    lsn_t runEnd;
+    size_t threads;
+    // whether any of the runs is read as a compressed run (see RunCodec)
+    bool compressed;
+
+    // Only set on worker scanners, which take runs from a shared queue
+    LogArchiver::ArchiveDirectory* directory;
+    std::vector<RunJob>* jobs;
+    std::atomic<size_t>* nextJob;
+    // Pairs of original handler and the clone used by this worker
+    std::vector<std::pair<Handler*, Handler*>> clones;
 
-    void findFirstFile();
-    string getNextFile();
+    void listRuns(std::vector<RunJob>& runs);
+    void addCompressedProbes(RunJob& job);
+    bool filterProbes(RunJob& job);
+    void scanRun(const RunJob& job);
+    bool scanWithClones(std::vector<RunJob>& runs);
+    void scanWithBatches(std::vector<RunJob>& runs);
+    bool cloneHandlers(LogArchiveScanner* worker);
+    void workerLoop();
 };
 
 class MergeScanner : public BaseScanner {
@@ -82,6 +405,8 @@ public:
     virtual void run();
 private:
     string archdir;
+    size_t threads;
+    bool ordered;
 };
 
 #endif
@@ -13,6 +13,9 @@ void AggLog::setupOptions()
             "Only begin aggregation once logrec of given type is found")
         ("end,e", po::value<string>(&endType)->default_value(""),
             "Finish aggregation once logrec of given type is found")
+        ("format", po::value<string>(&format)->default_value("text"),
+            "Output format: text (tab-separated columns), csv or json \
+            (one object per line)")
     ;
     options.add(agglog);
 }
@@ -50,7 +53,8 @@ void AggLog::run()
         }
     }
 
-    AggregateHandler h(filter, interval, begin, end);
+    AggregateHandler h(filter, interval, begin, end,
+            AggregateHandler::parseFormat(format), follow);
 
     // filter must not ignore tick log records
     filter.set(logrec_t::t_tick_sec);
@@ -68,28 +72,32 @@ void AggLog::run()
 }
 
 AggregateHandler::AggregateHandler(bitset<logrec_t::t_max_logrec> filter,
-        int interval, logrec_t::kind_t begin, logrec_t::kind_t end)
-    : filter(filter), interval(interval), currentTick(0),
-    begin(begin), end(end), seenBegin(false)
+        int interval, logrec_t::kind_t begin, logrec_t::kind_t end,
+        Format format, bool flushWindows)
+    : filter(filter), interval(interval), currentTick(0), window(0),
+    begin(begin), end(end), seenBegin(false), format(format),
+    flushWindows(flushWindows), headerDone(false), persisted(false)
 {
     assert(interval > 0);
-    counts.reserve(logrec_t::t_max_logrec);
-    for (size_t i = 0; i < logrec_t::t_max_logrec; i++) {
-        counts[i] = 0;
-    }
+    memset(counts, 0, sizeof(counts));
+    memset(bytes, 0, sizeof(bytes));
 
     if (begin == logrec_t::t_max_logrec) {
         seenBegin = true;
     }
+}
 
-    // print header line with type names
-    cout << "#";
-    for (int i = 0; i < logrec_t::t_max_logrec; i++) {
-        if (filter[i]) {
-            cout << " " << logrec_t::get_type_str((logrec_t::kind_t) i);
-        }
-    }
-    cout << flushl;
+AggregateHandler::~AggregateHandler()
+{
+    flushBuffer();
+}
+
+AggregateHandler::Format AggregateHandler::parseFormat(const string& str)
+{
+    if (str == "text") { return TEXT; }
+    if (str == "csv") { return CSV; }
+    if (str == "json") { return JSON; }
+    throw runtime_error("Invalid output format: " + str);
 }
 
 void AggregateHandler::invoke(logrec_t& r)
@@ -117,21 +125,154 @@ void AggregateHandler::invoke(logrec_t& r)
     }
     else if (filter[r.type()]) {
         counts[r.type()]++;
+        bytes[r.type()] += r.length();
+        sizes.push_back(r.length());
     }
 }
 
-void AggregateHandler::dumpCounts()
+void AggregateHandler::printHeader()
 {
-    for (size_t i = 0; i < counts.capacity(); i++) {
+    headerDone = true;
+    if (format == JSON) {
+        return;
+    }
+
+    // header line with type names
+    buffer << (format == TEXT ? "#" : "window");
+    for (int i = 0; i < logrec_t::t_max_logrec; i++) {
         if (filter[i]) {
-            cout << counts[i] << '\t';
-            counts[i] = 0;
+            const char* type = logrec_t::get_type_str((logrec_t::kind_t) i);
+            if (format == TEXT) {
+                buffer << " " << type << " " << type << "_bytes";
+            }
+            else {
+                buffer << "," << type << "_count," << type << "_bytes";
+            }
         }
     }
-    cout << flushl;
+    if (format == TEXT) {
+        buffer << " size_p50 size_p90 size_p99 size_max";
+    }
+    else {
+        buffer << ",size_p50,size_p90,size_p99,size_max";
+    }
+    buffer << "\n";
+}
+
+uint32_t AggregateHandler::getPercentile(double p)
+{
+    if (sizes.empty()) {
+        return 0;
+    }
+    size_t k = std::min((size_t) (p * sizes.size()), sizes.size() - 1);
+    std::nth_element(sizes.begin(), sizes.begin() + k, sizes.end());
+    return sizes[k];
+}
+
+void AggregateHandler::dumpCounts()
+{
+    if (!headerDone) {
+        printHeader();
+    }
+
+    uint32_t p50 = getPercentile(0.5);
+    uint32_t p90 = getPercentile(0.9);
+    uint32_t p99 = getPercentile(0.99);
+    uint32_t max = sizes.empty() ? 0 :
+        *std::max_element(sizes.begin(), sizes.end());
+
+    switch (format) {
+        case TEXT:
+            for (size_t i = 0; i < logrec_t::t_max_logrec; i++) {
+                if (filter[i]) {
+                    buffer << counts[i] << '\t' << bytes[i] << '\t';
+                }
+            }
+            buffer << p50 << '\t' << p90 << '\t' << p99 << '\t' << max;
+            break;
+        case CSV:
+            buffer << window;
+            for (size_t i = 0; i < logrec_t::t_max_logrec; i++) {
+                if (filter[i]) {
+                    buffer << "," << counts[i] << "," << bytes[i];
+                }
+            }
+            buffer << "," << p50 << "," << p90 << "," << p99 << "," << max;
+            break;
+        case JSON:
+        {
+            bool first = true;
+            buffer << "{\"window\":" << window << ",\"types\":{";
+            for (size_t i = 0; i < logrec_t::t_max_logrec; i++) {
+                if (filter[i]) {
+                    buffer << (first ? "" : ",") << "\""
+                        << logrec_t::get_type_str((logrec_t::kind_t) i)
+                        << "\":{\"count\":" << counts[i]
+                        << ",\"bytes\":" << bytes[i] << "}";
+                    first = false;
+                }
+            }
+            buffer << "},\"size\":{\"p50\":" << p50 << ",\"p90\":" << p90
+                << ",\"p99\":" << p99 << ",\"max\":" << max << "}}";
+            break;
+        }
+    }
+    buffer << "\n";
+
+    memset(counts, 0, sizeof(counts));
+    memset(bytes, 0, sizeof(bytes));
+    sizes.clear();
+    window++;
+
+    if (flushWindows || buffer.tellp() >= (std::streampos) FLUSH_SIZE) {
+        flushBuffer();
+    }
+}
+
+void AggregateHandler::flushBuffer()
+{
+    string s = buffer.str();
+    if (!s.empty()) {
+        cout.write(s.data(), s.size());
+        cout.flush();
+        buffer.str("");
+    }
+}
+
+void AggregateHandler::saveState(std::ostream& out)
+{
+    out << currentTick << " " << seenBegin << " " << window;
+    for (size_t i = 0; i < logrec_t::t_max_logrec; i++) {
+        out << " " << counts[i] << " " << bytes[i];
+    }
+    out << " " << sizes.size();
+    for (size_t i = 0; i < sizes.size(); i++) {
+        out << " " << sizes[i];
+    }
+    persisted = true;
+}
+
+void AggregateHandler::loadState(std::istream& in)
+{
+    size_t sizeCount = 0;
+    in >> currentTick >> seenBegin >> window;
+    for (size_t i = 0; i < logrec_t::t_max_logrec; i++) {
+        in >> counts[i] >> bytes[i];
+    }
+    in >> sizeCount;
+    sizes.resize(sizeCount);
+    for (size_t i = 0; i < sizeCount; i++) {
+        in >> sizes[i];
+    }
+
+    // output continues that of the previous run
+    headerDone = true;
 }
 
 void AggregateHandler::finalize()
 {
-    dumpCounts();
+    if (!persisted) {
+        dumpCounts();
+    }
+    flushBuffer();
 }
@@ -17,26 +17,63 @@ private:
     string beginType;
     string endType;
     int interval;
+    string format;
 };
 
+/*
+ * Aggregates log records into windows of a given number of ticks, i.e.,
+ * seconds or milliseconds depending on the tick log records in the log. For
+ * each window, the count and byte volume of each selected log record type
+ * and percentiles of the record size are printed. Output is buffered and
+ * written out in large chunks, unless flushWindows is set (e.g., when
+ * following a live log).
+ */
 class AggregateHandler : public Handler {
 public:
+    enum Format { TEXT, CSV, JSON };
+
     AggregateHandler(bitset<logrec_t::t_max_logrec> filter, int interval = 1,
             logrec_t::kind_t begin = logrec_t::t_max_logrec,
-            logrec_t::kind_t end = logrec_t::t_max_logrec);
+            logrec_t::kind_t end = logrec_t::t_max_logrec,
+            Format format = TEXT, bool flushWindows = false);
+    virtual ~AggregateHandler();
+
     virtual void invoke(logrec_t& r);
     virtual void finalize();
+    virtual void saveState(std::ostream& out);
+    virtual void loadState(std::istream& in);
+
+    static Format parseFormat(const string& str);
 protected:
-    vector<unsigned> counts;
+    uint64_t counts[logrec_t::t_max_logrec];
+    uint64_t bytes[logrec_t::t_max_logrec];
+    // sizes of the selected records in the current window
+    vector<uint32_t> sizes;
+
     bitset<logrec_t::t_max_logrec> filter;
     const int interval;
     int currentTick;
+    size_t window;
 
     logrec_t::kind_t begin;
     logrec_t::kind_t end;
     bool seenBegin;
 
+    Format format;
+    bool flushWindows;
+    bool headerDone;
+    std::ostringstream buffer;
+
+    // set once the state is saved, so that the interval is not dumped
+    // before it is completed by a later run
+    bool persisted;
+
+    static const size_t FLUSH_SIZE = 1024 * 1024;
+
     void dumpCounts();
+    void printHeader();
+    void flushBuffer();
+    uint32_t getPercentile(double p);
 };
 
 #endif
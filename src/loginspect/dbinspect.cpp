@@ -2,6 +2,12 @@
 
 #include "bf_fixed.h"
 #include "alloc_cache.h"
+#include "btree_page_h.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 void DBInspect::setupOptions()
 {
@@ -9,10 +15,158 @@ void DBInspect::setupOptions()
     opt.add_options()
         ("file,f", po::value<string>(&file)->required(),
          "DB file to be inspected")
+        ("threads", po::value<size_t>(&threads)->default_value(1),
+         "Number of threads which inspect disjoint page ranges in parallel")
+        ("pages", po::value<bool>(&dumpPages)->default_value(false)
+         ->implicit_value(true),
+         "Print PID, LSN, checksum and allocation status of every page")
+        ("logdir,l", po::value<string>(&logdir)->default_value(""),
+         "Recovery log directory, used to compute page LSN age relative to \
+         the end of the log (default: relative to the highest page LSN)")
         ;
     options.add(opt);
 }
 
+void PageScanStats::ClassStats::merge(const ClassStats& other)
+{
+    pages += other.pages;
+    fillSum += other.fillSum;
+    keys += other.keys;
+    ghosts += other.ghosts;
+}
+
+static string getPageClass(const generic_page* page)
+{
+    switch (page->tag) {
+        case t_alloc_p: return "alloc";
+        case t_stnode_p: return "stnode";
+        case t_btree_p:
+        {
+            btree_page_h bp;
+            bp.fix_nonbufferpool_page(const_cast<generic_page*>(page));
+            return bp.is_leaf() ? "btree_leaf" : "btree_interior";
+        }
+        default:
+        {
+            stringstream ss;
+            ss << "tag_" << page->tag;
+            return ss.str();
+        }
+    }
+}
+
+PageScanStats::PageScanStats()
+    : pages(0), allocated(0), badChecksums(0), unallocatedWritten(0),
+    minLSN(lsn_t::null), maxLSN(lsn_t::null)
+{}
+
+void PageScanStats::merge(const PageScanStats& other)
+{
+    pages += other.pages;
+    allocated += other.allocated;
+    badChecksums += other.badChecksums;
+    unallocatedWritten += other.unallocatedWritten;
+
+    if (other.minLSN != lsn_t::null &&
+            (minLSN == lsn_t::null || other.minLSN < minLSN))
+    {
+        minLSN = other.minLSN;
+    }
+    if (maxLSN < other.maxLSN) {
+        maxLSN = other.maxLSN;
+    }
+    for (auto it = other.lsnPartitions.begin();
+            it != other.lsnPartitions.end(); it++)
+    {
+        lsnPartitions[it->first] += it->second;
+    }
+    for (auto it = other.classes.begin(); it != other.classes.end(); it++) {
+        classes[it->first].merge(it->second);
+    }
+    for (auto it = other.stores.begin(); it != other.stores.end(); it++) {
+        stores[it->first].merge(it->second);
+    }
+}
+
+PageRangeInspector::PageRangeInspector(const char* base, shpid_t first,
+        shpid_t last, alloc_cache_t* alloc, bool dumpPages,
+        pthread_mutex_t* dumpMutex)
+    : smthread_t(t_regular, "PageRangeInspector"),
+    base(base), first(first), last(last), alloc(alloc), dumpPages(dumpPages),
+    dumpMutex(dumpMutex)
+{
+}
+
+void PageRangeInspector::flushDump()
+{
+    DO_PTHREAD(pthread_mutex_lock(dumpMutex));
+    cout << dump.str();
+    DO_PTHREAD(pthread_mutex_unlock(dumpMutex));
+    dump.str("");
+}
+
+void PageRangeInspector::run()
+{
+    for (shpid_t p = first; p < last; p++) {
+        const generic_page* page =
+            (const generic_page*) (base + p * sizeof(generic_page));
+
+        bool checksumOK = page->checksum == page->calculate_checksum();
+        bool isAllocated = alloc->is_allocated_page(p);
+
+        stats.pages++;
+        if (isAllocated) { stats.allocated++; }
+        if (!checksumOK) { stats.badChecksums++; }
+
+        lsn_t lsn = page->lsn;
+        if (lsn != lsn_t::null) {
+            if (!isAllocated) { stats.unallocatedWritten++; }
+            if (stats.minLSN == lsn_t::null || lsn < stats.minLSN) {
+                stats.minLSN = lsn;
+            }
+            if (stats.maxLSN < lsn) {
+                stats.maxLSN = lsn;
+            }
+            stats.lsnPartitions[lsn.hi()]++;
+        }
+
+        // only allocated pages have a meaningful header
+        if (isAllocated) {
+            PageScanStats::ClassStats c;
+            c.pages = 1;
+            // the header of a corrupt page cannot be trusted, and a page
+            // without fence record has no valid item count
+            if (page->tag == t_btree_p && checksumOK) {
+                btree_page_h bp;
+                bp.fix_nonbufferpool_page(const_cast<generic_page*>(page));
+                if (bp.nrecs() >= 0) {
+                    c.fillSum = 1.0 - (double) bp.usable_space()
+                        / btree_page_data::data_sz;
+                    for (slotid_t s = 0; s < bp.nrecs(); s++) {
+                        if (bp.is_ghost(s)) { c.ghosts++; }
+                    }
+                    c.keys = bp.nrecs() - c.ghosts;
+                }
+            }
+            stats.classes[getPageClass(page)].merge(c);
+            stats.stores[std::make_pair(page->pid.vol(), page->pid.store())]
+                .merge(c);
+        }
+
+        if (dumpPages) {
+            dump << "Page=" << p
+                << " PID=" << page->pid
+                << " LSN=" << lsn
+                << " Checksum=" << (checksumOK ? "OK" : "WRONG")
+                << " Alloc=" << (isAllocated ? "YES" : "NO")
+                << "\n";
+            if ((p - first + 1) % DUMP_CHUNK == 0 || p + 1 == last) {
+                flushDump();
+            }
+        }
+    }
+}
+
 void DBInspect::run()
 {
     // Build alloc_cache to get allocation status of pages
@@ -31,29 +185,117 @@ void DBInspect::run()
     alloc_cache_t alloc(&bf_fixed);
     alloc.load_by_scan(max_pid);
 
-    // Iterate and print info about pages
-    ifstream in(file, std::ifstream::binary);
-    generic_page page;
+    if (max_pid == 0) {
+        return;
+    }
+
+    // Pages are read directly from a read-only mapping of the volume
+    int mfd = ::open(file.c_str(), O_RDONLY);
+    if (mfd < 0) {
+        throw runtime_error("Could not open DB file " + file);
+    }
+    size_t mapSize = max_pid * sizeof(generic_page);
+    char* base = (char*) mmap(NULL, mapSize, PROT_READ, MAP_SHARED, mfd, 0);
+    if (base == MAP_FAILED) {
+        ::close(mfd);
+        throw runtime_error("Could not map DB file " + file);
+    }
+    madvise(base, mapSize, MADV_SEQUENTIAL);
 
     // Volume header page can be just printed out
-    in.seekg(0);
-    in.read((char*) &page, sizeof(generic_page));
-    cout << (char*) &page << endl;
+    cout << string(base, strnlen(base, sizeof(generic_page))) << endl;
+
+    // Remaining pages are split into one contiguous range per thread
+    size_t workers = std::max<size_t>(1, std::min<size_t>(threads,
+                max_pid - 1));
+    std::vector<PageRangeInspector*> inspectors;
+    pthread_mutex_t dumpMutex;
+    DO_PTHREAD(pthread_mutex_init(&dumpMutex, NULL));
+    shpid_t first = 1;
+    for (size_t i = 0; i < workers; i++) {
+        shpid_t last = 1 + (uint64_t) (max_pid - 1) * (i + 1) / workers;
+        inspectors.push_back(new PageRangeInspector(base, first, last,
+                    &alloc, dumpPages, &dumpMutex));
+        inspectors[i]->fork();
+        first = last;
+    }
+
+    PageScanStats stats;
+    for (size_t i = 0; i < workers; i++) {
+        inspectors[i]->join();
+        stats.merge(inspectors[i]->getStats());
+        delete inspectors[i];
+    }
+    DO_PTHREAD(pthread_mutex_destroy(&dumpMutex));
 
-    shpid_t p = 1;
-    while (in) {
-        in.seekg(p * sizeof(generic_page));
-        in.read((char*) &page, sizeof(generic_page));
-        if (!in) { break; }
+    munmap(base, mapSize);
+    ::close(mfd);
 
-        cout << "Page=" << p
-            << " PID=" << page.pid
-            << " LSN=" << page.lsn
-            << " Checksum="
-            << (page.checksum == page.calculate_checksum() ? "OK" : "WRONG")
-            << " Alloc=" << (alloc.is_allocated_page(p) ? "YES" : "NO")
-            << endl;
-        p++;
+    cout << "pages=" << stats.pages
+        << " allocated=" << stats.allocated
+        << " bad_checksums=" << stats.badChecksums
+        << " unallocated_written=" << stats.unallocatedWritten
+        << endl;
+    cout << "min_lsn=" << stats.minLSN
+        << " max_lsn=" << stats.maxLSN << endl;
+    cout << "LSN DISTRIBUTION" << endl;
+    for (auto it = stats.lsnPartitions.begin();
+            it != stats.lsnPartitions.end(); it++)
+    {
+        cout << "partition=" << it->first << " pages=" << it->second << "\n";
     }
+
+    // age is the number of log partitions between page LSN and log end
+    lsn_t logEnd = getLogEnd(stats.maxLSN);
+    cout << "LSN AGE (log end " << logEnd << ")" << endl;
+    for (auto it = stats.lsnPartitions.rbegin();
+            it != stats.lsnPartitions.rend(); it++)
+    {
+        cout << "age_partitions=" << (long) logEnd.hi() - (long) it->first
+            << " pages=" << it->second << "\n";
+    }
+
+    cout << "PAGE CLASSES" << endl;
+    for (auto it = stats.classes.begin(); it != stats.classes.end(); it++) {
+        const PageScanStats::ClassStats& c = it->second;
+        cout << "class=" << it->first
+            << " pages=" << c.pages
+            << " avg_fill=" << c.fillSum / c.pages
+            << " keys=" << c.keys
+            << " ghosts=" << c.ghosts
+            << "\n";
+    }
+
+    cout << "STORES" << endl;
+    for (auto it = stats.stores.begin(); it != stats.stores.end(); it++) {
+        const PageScanStats::ClassStats& c = it->second;
+        cout << "vol=" << it->first.first
+            << " store=" << it->first.second
+            << " pages=" << c.pages
+            << " avg_fill=" << c.fillSum / c.pages
+            << " keys=" << c.keys
+            << "\n";
+    }
+    cout << flush;
 }
 
+lsn_t DBInspect::getLogEnd(const lsn_t& maxPageLSN)
+{
+    if (logdir.empty()) {
+        return maxPageLSN;
+    }
+
+    std::vector<int> partitions;
+    BlockScanner::listPartitions(logdir, partitions);
+    if (partitions.empty()) {
+        return maxPageLSN;
+    }
+
+    stringstream fname;
+    fname << logdir << "/log." << partitions.back();
+    struct stat st;
+    if (::stat(fname.str().c_str(), &st) != 0) {
+        throw runtime_error("Could not stat log file " + fname.str());
+    }
+    return lsn_t(partitions.back(), st.st_size);
+}
@@ -3,6 +3,11 @@
 
 #include "command.h"
 
+#include <map>
+#include <sstream>
+
+class alloc_cache_t;
+
 class DBInspect : public Command {
 public:
     void usage();
@@ -10,6 +15,79 @@ public:
     void setupOptions();
 private:
     string file;
+    size_t threads;
+    bool dumpPages;
+    string logdir;
+
+    lsn_t getLogEnd(const lsn_t& maxPageLSN);
+};
+
+/*
+ * Results of inspecting a range of pages, computed by one thread and merged
+ * into the totals once all threads are done.
+ */
+struct PageScanStats {
+    uint64_t pages;
+    uint64_t allocated;
+    uint64_t badChecksums;
+    // pages not allocated according to the alloc pages, but with an LSN
+    uint64_t unallocatedWritten;
+
+    lsn_t minLSN;
+    lsn_t maxLSN;
+    // number of pages per partition of the page LSN
+    std::map<uint32_t, uint64_t> lsnPartitions;
+
+    /*
+     * Pages by class (see getPageClass) and per store. Fill factor is the
+     * fraction of the B-tree page data area in use, and keys are the
+     * non-ghost records of B-tree pages (excluding the fence record).
+     */
+    struct ClassStats {
+        uint64_t pages;
+        double fillSum;
+        uint64_t keys;
+        uint64_t ghosts;
+        ClassStats() : pages(0), fillSum(0), keys(0), ghosts(0) {}
+        void merge(const ClassStats& other);
+    };
+    std::map<string, ClassStats> classes;
+    std::map<std::pair<uint32_t, uint32_t>, ClassStats> stores;
+
+    PageScanStats();
+    void merge(const PageScanStats& other);
+};
+
+/*
+ * Inspects the pages [first, last) of a volume mapped into memory. With
+ * dumpPages, one line per page is printed. Lines are collected for a chunk
+ * of DUMP_CHUNK pages at a time and written to cout while holding the given
+ * mutex, so chunks of different threads may interleave, but lines do not.
+ */
+class PageRangeInspector : public smthread_t {
+public:
+    static const shpid_t DUMP_CHUNK = 4096;
+
+    PageRangeInspector(const char* base, shpid_t first, shpid_t last,
+            alloc_cache_t* alloc, bool dumpPages, pthread_mutex_t* dumpMutex);
+    virtual ~PageRangeInspector() {}
+
+    virtual void run();
+
+    const PageScanStats& getStats() const { return stats; }
+
+private:
+    const char* base;
+    shpid_t first;
+    shpid_t last;
+    alloc_cache_t* alloc;
+    bool dumpPages;
+    pthread_mutex_t* dumpMutex;
+
+    PageScanStats stats;
+    std::ostringstream dump;
+
+    void flushDump();
 };
 
 #endif
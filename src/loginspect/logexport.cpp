@@ -0,0 +1,178 @@
+#include "logexport.h"
+
+const char ExportHandler::MAGIC[8] = {'Z', 'L', 'O', 'G', 'C', 'O', 'L', '1'};
+
+void LogExport::setupOptions()
+{
+    LogScannerCommand::setupOptions();
+    po::options_description opt("Export Options");
+    opt.add_options()
+        ("output,o", po::value<string>(&outFile)->required(),
+            "Path of the columnar output file")
+        ("rows-per-block", po::value<size_t>(&rowsPerBlock)
+            ->default_value(65536),
+            "Number of log records per block of the output file")
+    ;
+    options.add(opt);
+}
+
+void LogExport::run()
+{
+    if (rowsPerBlock == 0) {
+        throw runtime_error("Number of rows per block must be positive");
+    }
+
+    ExportHandler* h = new ExportHandler(outFile, rowsPerBlock);
+    BaseScanner* s = getScanner();
+
+    s->any_handlers.push_back(h);
+    s->fork();
+    s->join();
+
+    delete s;
+    delete h;
+}
+
+ExportHandler::ExportHandler(string outFile, size_t rowsPerBlock)
+    : rowsPerBlock(rowsPerBlock), rows(0), tick(0), totalRows(0)
+{
+    out.exceptions(ofstream::failbit | ofstream::badbit);
+    out.open(outFile, ios::binary | ios::out | ios::trunc);
+
+    FileHeader header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.columns = COL_COUNT;
+    out.write((char*) &header, sizeof(FileHeader));
+
+    for (int c = 0; c < COL_COUNT; c++) {
+        values[c].reserve(rowsPerBlock);
+        columnBytes[c] = 0;
+    }
+}
+
+ExportHandler::~ExportHandler()
+{
+    if (out.is_open()) {
+        out.close();
+    }
+}
+
+const char* ExportHandler::getColumnName(Column c)
+{
+    switch (c) {
+        case COL_LSN: return "lsn";
+        case COL_TYPE: return "type";
+        case COL_LENGTH: return "length";
+        case COL_STORE: return "store";
+        case COL_PAGE: return "page";
+        case COL_TID: return "tid";
+        case COL_PAGE_PREV_LSN: return "page_prev_lsn";
+        case COL_TICK: return "tick";
+        default: return "unknown";
+    }
+}
+
+void ExportHandler::invoke(logrec_t& r)
+{
+    if (r.type() == logrec_t::t_tick_sec || r.type() == logrec_t::t_tick_msec)
+    {
+        tick++;
+    }
+
+    bool hasPid = !r.null_pid();
+    lpid_t pid = hasPid ? r.pid() : lpid_t::null;
+
+    values[COL_LSN].push_back(r.lsn_ck().data());
+    values[COL_TYPE].push_back(r.type());
+    values[COL_LENGTH].push_back(r.length());
+    values[COL_STORE].push_back(((uint64_t) pid.vol() << 32) | pid.store());
+    values[COL_PAGE].push_back(pid.page);
+    values[COL_TID].push_back(r.tid().as_int64());
+    values[COL_PAGE_PREV_LSN].push_back(
+            hasPid ? r.page_prev_lsn().data() : 0);
+    values[COL_TICK].push_back(tick);
+
+    rows++;
+    if (rows == rowsPerBlock) {
+        flushBlock();
+    }
+}
+
+void ExportHandler::encodeColumn(Column c, uint64_t& min, uint64_t& max)
+{
+    std::vector<uint64_t>& v = values[c];
+    encoded.clear();
+    min = max = v.empty() ? 0 : v[0];
+
+    uint64_t prev = 0;
+    for (size_t i = 0; i < v.size(); i++) {
+        if (v[i] < min) { min = v[i]; }
+        if (v[i] > max) { max = v[i]; }
+
+        if (c == COL_TYPE) {
+            encoded.push_back((char) v[i]);
+            continue;
+        }
+
+        // zigzag-encoded delta, written as a varint
+        int64_t delta = (int64_t) (v[i] - prev);
+        uint64_t zz = ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+        while (zz >= 0x80) {
+            encoded.push_back((char) (zz | 0x80));
+            zz >>= 7;
+        }
+        encoded.push_back((char) zz);
+        prev = v[i];
+    }
+}
+
+void ExportHandler::flushBlock()
+{
+    if (rows == 0) { return; }
+
+    BlockHeader header;
+    header.rows = rows;
+    header.columns = COL_COUNT;
+
+    // header is rewritten once column sizes are known
+    uint64_t blockOffset = out.tellp();
+    out.write((char*) &header, sizeof(BlockHeader));
+
+    for (int c = 0; c < COL_COUNT; c++) {
+        encodeColumn((Column) c, header.min[c], header.max[c]);
+        header.size[c] = encoded.size();
+        out.write(encoded.data(), encoded.size());
+        columnBytes[c] += encoded.size();
+        values[c].clear();
+    }
+
+    uint64_t blockEnd = out.tellp();
+    out.seekp(blockOffset);
+    out.write((char*) &header, sizeof(BlockHeader));
+    out.seekp(blockEnd);
+
+    blockOffsets.push_back(blockOffset);
+    totalRows += rows;
+    rows = 0;
+}
+
+void ExportHandler::finalize()
+{
+    flushBlock();
+
+    out.write((char*) blockOffsets.data(),
+            blockOffsets.size() * sizeof(uint64_t));
+    FileFooter footer;
+    footer.blockCount = blockOffsets.size();
+    memcpy(footer.magic, MAGIC, sizeof(MAGIC));
+    out.write((char*) &footer, sizeof(FileFooter));
+    out.close();
+
+    cout << "exported_logrecs " << totalRows << endl;
+    cout << "exported_blocks " << blockOffsets.size() << endl;
+    for (int c = 0; c < COL_COUNT; c++) {
+        cout << "column_bytes " << getColumnName((Column) c)
+            << " " << columnBytes[c] << endl;
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef LOGEXPORT_H
+#define LOGEXPORT_H
+
+#include "command.h"
+#include "handler.h"
+
+#include <fstream>
+
+class LogExport : public LogScannerCommand {
+public:
+    void run();
+    void setupOptions();
+
+private:
+    string outFile;
+    size_t rowsPerBlock;
+};
+
+/*
+ * Writes log record metadata into a columnar binary file. Records are
+ * grouped into blocks of a fixed number of rows; within a block, each column
+ * is stored contiguously and encoded as zigzag varints of the deltas between
+ * consecutive values (except the type column, which takes one byte per row).
+ *
+ * File layout:
+ *   FileHeader
+ *   for each block: BlockHeader, column 0 bytes, ..., column N-1 bytes
+ *   block offsets (uint64_t each), FileFooter
+ *
+ * Block headers carry min/max of each column and the encoded size of each
+ * column, so readers can skip blocks and columns without decoding them.
+ */
+class ExportHandler : public Handler {
+public:
+    enum Column {
+        COL_LSN = 0,
+        COL_TYPE,
+        COL_LENGTH,
+        COL_STORE,      // volume << 32 | store number
+        COL_PAGE,
+        COL_TID,
+        COL_PAGE_PREV_LSN,
+        COL_TICK,
+        COL_COUNT
+    };
+
+    static const char MAGIC[8];
+    static const uint32_t VERSION = 1;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t columns;
+    };
+
+    struct BlockHeader {
+        uint32_t rows;
+        uint32_t columns;
+        uint64_t min[COL_COUNT];
+        uint64_t max[COL_COUNT];
+        uint64_t size[COL_COUNT];
+    };
+
+    struct FileFooter {
+        uint64_t blockCount;
+        char magic[8];
+    };
+
+    ExportHandler(string outFile, size_t rowsPerBlock);
+    virtual ~ExportHandler();
+
+    virtual void invoke(logrec_t& r);
+    virtual void finalize();
+
+    static const char* getColumnName(Column c);
+
+private:
+    ofstream out;
+    size_t rowsPerBlock;
+    size_t rows;
+    uint64_t tick;
+    uint64_t totalRows;
+    uint64_t columnBytes[COL_COUNT];
+
+    std::vector<uint64_t> values[COL_COUNT];
+    std::vector<uint64_t> blockOffsets;
+    string encoded;
+
+    void flushBlock();
+    void encodeColumn(Column c, uint64_t& min, uint64_t& max);
+};
+
+#endif
@@ -1,57 +1,213 @@
 #include "logpagestats.h"
+#include "helpers.h"
 
-class LogPageStatsHandler : public Handler {
-public:
-    size_t pageCount;
-    size_t logrecs;
-    size_t volume;
-    lpid_t currentPage;
-
-    LogPageStatsHandler() : pageCount(0), logrecs(0), volume(0),
-        currentPage(lpid_t::null)
-    {}
-
-    virtual void invoke(logrec_t& r)
-    {
-        lpid_t pid = r.pid();
-        if (pid != currentPage) {
-            dumpCurrent();
-
-            logrecs = 0;
-            volume = 0;
-            currentPage = pid;
-            pageCount++;
+#include <algorithm>
+#include <map>
+
+LogPageStatsHandler::LogPageStatsHandler(size_t topK, bool allPages)
+    : table(1 << 16), pageCount(0), noPageLogrecs(0), topK(topK),
+    allPages(allPages)
+{}
+
+uint64_t LogPageStatsHandler::hash(const lpid_t& pid)
+{
+    uint64_t k = ((uint64_t) pid.store() << 32) | pid.page;
+    k ^= (uint64_t) pid.vol() << 56;
+    // 64-bit finalizer of MurmurHash3
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+LogPageStatsHandler::Entry& LogPageStatsHandler::lookup(const lpid_t& pid)
+{
+    // table size is a power of two; linear probing
+    size_t mask = table.size() - 1;
+    size_t i = hash(pid) & mask;
+    while (table[i].used && table[i].pid != pid) {
+        i = (i + 1) & mask;
+    }
+
+    if (!table[i].used) {
+        // keep load factor below 0.7
+        if ((pageCount + 1) * 10 > table.size() * 7) {
+            grow();
+            return lookup(pid);
+        }
+        table[i].used = true;
+        table[i].pid = pid;
+        pageCount++;
+    }
+    return table[i];
+}
+
+void LogPageStatsHandler::grow()
+{
+    std::vector<Entry> old(table.size() * 2);
+    old.swap(table);
+    pageCount = 0;
+    for (size_t i = 0; i < old.size(); i++) {
+        if (old[i].used) {
+            add(old[i].pid, old[i].logrecs, old[i].volume);
         }
+    }
+}
 
-        logrecs++;
-        volume += r.length();
+void LogPageStatsHandler::add(const lpid_t& pid, uint64_t logrecs,
+        uint64_t volume)
+{
+    Entry& e = lookup(pid);
+    e.logrecs += logrecs;
+    e.volume += volume;
+}
+
+void LogPageStatsHandler::invoke(logrec_t& r)
+{
+    if (r.null_pid()) {
+        noPageLogrecs++;
+        return;
     }
+    add(r.pid(), 1, r.length());
+}
 
-    void dumpCurrent() {
-        if (logrecs == 0) { return; }
+Handler* LogPageStatsHandler::clone()
+{
+    return new LogPageStatsHandler(topK, allPages);
+}
+
+void LogPageStatsHandler::merge(Handler* clone)
+{
+    LogPageStatsHandler* other = dynamic_cast<LogPageStatsHandler*>(clone);
+    w_assert0(other);
 
-        cout << "pid=" << currentPage
-            << " count=" << logrecs
-            << " volume=" << volume
-            << endl;
+    for (size_t i = 0; i < other->table.size(); i++) {
+        if (other->table[i].used) {
+            add(other->table[i].pid, other->table[i].logrecs,
+                    other->table[i].volume);
+        }
     }
+    noPageLogrecs += other->noPageLogrecs;
+}
 
-    virtual void finalize()
-    {
-        dumpCurrent();
-        pageCount++;
-        cout << "TOTAL_PAGES=" << pageCount << endl;
+void LogPageStatsHandler::saveState(std::ostream& out)
+{
+    out << noPageLogrecs << " " << pageCount;
+    for (size_t i = 0; i < table.size(); i++) {
+        const Entry& e = table[i];
+        if (e.used) {
+            out << " " << e.pid.vol() << " " << e.pid.store()
+                << " " << e.pid.page << " " << e.logrecs << " " << e.volume;
+        }
+    }
+}
+
+void LogPageStatsHandler::loadState(std::istream& in)
+{
+    size_t count = 0;
+    in >> noPageLogrecs >> count;
+    for (size_t i = 0; i < count; i++) {
+        unsigned vol = 0, store = 0, page = 0;
+        uint64_t logrecs = 0, volume = 0;
+        in >> vol >> store >> page >> logrecs >> volume;
+        add(lpid_t(vol, store, page), logrecs, volume);
+    }
+}
+
+void LogPageStatsHandler::finalize()
+{
+    std::vector<const Entry*> pages;
+    pages.reserve(pageCount);
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table[i].used) {
+            pages.push_back(&table[i]);
+        }
+    }
+
+    if (allPages) {
+        std::sort(pages.begin(), pages.end(),
+                [] (const Entry* a, const Entry* b) { return a->pid < b->pid; });
+        for (size_t i = 0; i < pages.size(); i++) {
+            cout << "pid=" << pages[i]->pid
+                << " count=" << pages[i]->logrecs
+                << " volume=" << pages[i]->volume
+                << "\n";
+        }
+    }
+
+    // top-K pages by log volume
+    size_t k = std::min(topK, pages.size());
+    std::partial_sort(pages.begin(), pages.begin() + k, pages.end(),
+            [] (const Entry* a, const Entry* b) {
+                return a->volume > b->volume;
+            });
+    cout << "TOP PAGES" << endl;
+    for (size_t i = 0; i < k; i++) {
+        cout << "pid=" << pages[i]->pid
+            << " count=" << pages[i]->logrecs
+            << " volume=" << pages[i]->volume
+            << "\n";
+    }
+
+    // bucket b counts pages with log volume in [2^b, 2^(b+1))
+    uint64_t hist[HIST_BUCKETS] = {};
+    struct StoreStats {
+        uint64_t pages;
+        uint64_t logrecs;
+        uint64_t volume;
     };
-};
+    std::map<std::pair<unsigned, unsigned>, StoreStats> stores;
+    uint64_t totalVolume = 0;
+    for (size_t i = 0; i < pages.size(); i++) {
+        const Entry* e = pages[i];
+        hist[log2Bucket(e->volume, HIST_BUCKETS)]++;
+
+        StoreStats& s = stores[std::make_pair(e->pid.vol(), e->pid.store())];
+        s.pages++;
+        s.logrecs += e->logrecs;
+        s.volume += e->volume;
+        totalVolume += e->volume;
+    }
+
+    cout << "VOLUME HISTOGRAM" << endl;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        if (hist[b] > 0) {
+            cout << "volume>=" << (1ull << b) << " pages=" << hist[b] << "\n";
+        }
+    }
+
+    cout << "STORES" << endl;
+    for (auto it = stores.begin(); it != stores.end(); it++) {
+        cout << "vol=" << it->first.first
+            << " store=" << it->first.second
+            << " pages=" << it->second.pages
+            << " count=" << it->second.logrecs
+            << " volume=" << it->second.volume
+            << "\n";
+    }
+
+    cout << "no_page_logrecs=" << noPageLogrecs << endl;
+    cout << "total_volume=" << totalVolume << endl;
+    cout << "TOTAL_PAGES=" << pageCount << endl;
+}
 
 void LogPageStats::setupOptions()
 {
     LogScannerCommand::setupOptions();
+    options.add_options()
+        ("top,k", po::value<size_t>(&topK)->default_value(20),
+            "Number of pages with the highest log volume to show")
+        ("all-pages", po::value<bool>(&allPages)->default_value(false)
+         ->implicit_value(true),
+            "Also show log record count and volume of every page")
+    ;
 }
 
 void LogPageStats::run()
 {
-    LogPageStatsHandler* h = new LogPageStatsHandler();
+    LogPageStatsHandler* h = new LogPageStatsHandler(topK, allPages);
     BaseScanner* s = getScanner();
 
     s->type_handlers.resize(logrec_t::t_max_logrec);
@@ -62,4 +218,3 @@ void LogPageStats::run()
     delete s;
     delete h;
 }
-
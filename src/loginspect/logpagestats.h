@@ -2,12 +2,60 @@
 #define LOGPAGESTATS_H
 
 #include "command.h"
+#include "handler.h"
 
 class LogPageStats : public LogScannerCommand {
 public:
     void usage();
     void run();
     void setupOptions();
+
+protected:
+    size_t topK;
+    bool allPages;
+};
+
+/*
+ * Accumulates the number and volume of log records per page in an
+ * open-addressing hash table, so records may arrive in any order (recovery
+ * log or archive). At the end, the hottest pages by log volume, a histogram
+ * of the log volume per page and aggregates per store are printed.
+ */
+class LogPageStatsHandler : public Handler {
+public:
+    static const size_t HIST_BUCKETS = 32;
+
+    LogPageStatsHandler(size_t topK = 20, bool allPages = false);
+    virtual ~LogPageStatsHandler() {}
+
+    virtual void invoke(logrec_t& r);
+    virtual void finalize();
+    virtual Handler* clone();
+    virtual void merge(Handler* clone);
+    virtual void saveState(std::ostream& out);
+    virtual void loadState(std::istream& in);
+
+private:
+    struct Entry {
+        lpid_t pid;
+        uint64_t logrecs;
+        uint64_t volume;
+        bool used;
+        Entry() : pid(lpid_t::null), logrecs(0), volume(0), used(false) {}
+    };
+
+    std::vector<Entry> table;
+    size_t pageCount;
+    // log records which do not refer to a page
+    uint64_t noPageLogrecs;
+
+    size_t topK;
+    bool allPages;
+
+    Entry& lookup(const lpid_t& pid);
+    void add(const lpid_t& pid, uint64_t logrecs, uint64_t volume);
+    void grow();
+    static uint64_t hash(const lpid_t& pid);
 };
 
 #endif
@@ -1,25 +1,405 @@
 #include "logstats.h"
+#include "archindex.h"
+#include "helpers.h"
 
-class LogStatsHandler : public Handler
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+LogStatsHandler::LogStatsHandler(bool isArchive)
+    : isArchive(isArchive), xctSlots(XCT_SLOTS)
+{
+    memset(&counters, 0, sizeof(Counters));
+}
+
+void LogStatsHandler::invoke(logrec_t& r)
+{
+    count(r);
+}
+
+void LogStatsHandler::invokeBatch(logrec_t** recs, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        count(*recs[i]);
+    }
+}
+
+inline void LogStatsHandler::count(logrec_t& r)
+{
+    unsigned type = r.type();
+    size_t length = r.length();
+
+    counters.count[type]++;
+    counters.bytes[type] += length;
+    counters.sizeHist[type][log2Bucket(length, HIST_BUCKETS)]++;
+
+    if (!files.empty()) {
+        files.back().count++;
+        files.back().bytes += length;
+    }
+
+    uint64_t tid = r.tid().as_int64();
+    if (tid != 0) {
+        countXct(tid, r.type() == logrec_t::t_xct_end ||
+                r.type() == logrec_t::t_xct_abort);
+    }
+}
+
+void LogStatsHandler::countXct(uint64_t tid, bool end)
+{
+    XctSlot& slot = xctSlots[tid % XCT_SLOTS];
+    if (slot.tid != tid) {
+        if (!xctOverflow.empty()) {
+            auto it = xctOverflow.find(tid);
+            if (it != xctOverflow.end()) {
+                it->second++;
+                if (end) {
+                    addXct(it->second);
+                    xctOverflow.erase(it);
+                }
+                return;
+            }
+        }
+        if (slot.tid != 0) {
+            // slot taken by another open transaction
+            if (end) {
+                addXct(1);
+            }
+            else {
+                xctOverflow[tid] = 1;
+            }
+            return;
+        }
+        slot.tid = tid;
+    }
+
+    slot.count++;
+    if (end) {
+        flushXct(slot);
+    }
+}
+
+void LogStatsHandler::flushXct(XctSlot& slot)
+{
+    if (slot.count == 0) { return; }
+    addXct(slot.count);
+    slot.tid = 0;
+    slot.count = 0;
+}
+
+void LogStatsHandler::addXct(uint64_t logrecs)
 {
-private:
-    bool isArchive;
+    counters.xctCount++;
+    counters.xctHist[log2Bucket(logrecs, HIST_BUCKETS)]++;
+    if (logrecs > counters.xctMax) {
+        counters.xctMax = logrecs;
+    }
+}
+
+void LogStatsHandler::flushAllXcts()
+{
+    for (size_t i = 0; i < xctSlots.size(); i++) {
+        flushXct(xctSlots[i]);
+    }
+    for (auto it = xctOverflow.begin(); it != xctOverflow.end(); it++) {
+        addXct(it->second);
+    }
+    xctOverflow.clear();
+}
+
+void LogStatsHandler::newFile(const char* fname)
+{
+    // a resumed scan continues the last file of the previous run
+    if (!files.empty() && files.back().name == fname) {
+        return;
+    }
+
+    FileStats f;
+    f.name = fname;
+    f.count = 0;
+    f.bytes = 0;
+    files.push_back(f);
+}
+
+Handler* LogStatsHandler::clone()
+{
+    return new LogStatsHandler(isArchive);
+}
+
+void LogStatsHandler::merge(Handler* clone)
+{
+    LogStatsHandler* other = dynamic_cast<LogStatsHandler*>(clone);
+    w_assert0(other);
 
-public:
+    // transactions still open in the clone are counted by it
+    other->flushAllXcts();
+    mergeCounters(other->counters);
+    files.insert(files.end(), other->files.begin(), other->files.end());
+}
+
+/*
+ * Counters are saved as a flat list of numbers, followed by the TIDs and
+ * record counts of the transactions still open, so that a transaction
+ * which spans the saved position is counted once, and by the per-file
+ * totals. File names are prefixed with their length, since they may
+ * contain spaces.
+ */
+void LogStatsHandler::saveState(std::ostream& out)
+{
+    const uint64_t* c = (const uint64_t*) &counters;
+    for (size_t i = 0; i < sizeof(Counters) / sizeof(uint64_t); i++) {
+        out << c[i] << " ";
+    }
+
+    size_t open = 0;
+    for (size_t i = 0; i < xctSlots.size(); i++) {
+        if (xctSlots[i].count > 0) { open++; }
+    }
+    out << open;
+    for (size_t i = 0; i < xctSlots.size(); i++) {
+        if (xctSlots[i].count > 0) {
+            out << " " << xctSlots[i].tid << " " << xctSlots[i].count;
+        }
+    }
+    out << " " << xctOverflow.size();
+    for (auto it = xctOverflow.begin(); it != xctOverflow.end(); it++) {
+        out << " " << it->first << " " << it->second;
+    }
 
-    LogStatsHandler(bool isArchive) : isArchive(isArchive)
-    {}
+    out << " " << files.size();
+    for (size_t i = 0; i < files.size(); i++) {
+        out << " " << files[i].name.size() << " " << files[i].name
+            << " " << files[i].count << " " << files[i].bytes;
+    }
+}
+
+void LogStatsHandler::loadState(std::istream& in)
+{
+    uint64_t* c = (uint64_t*) &counters;
+    for (size_t i = 0; i < sizeof(Counters) / sizeof(uint64_t); i++) {
+        in >> c[i];
+    }
+
+    size_t open = 0;
+    in >> open;
+    for (size_t i = 0; i < open; i++) {
+        uint64_t tid, logrecs;
+        in >> tid >> logrecs;
+        XctSlot& slot = xctSlots[tid % XCT_SLOTS];
+        slot.tid = tid;
+        slot.count = logrecs;
+    }
+    size_t overflow = 0;
+    in >> overflow;
+    for (size_t i = 0; i < overflow; i++) {
+        uint64_t tid, logrecs;
+        in >> tid >> logrecs;
+        xctOverflow[tid] = logrecs;
+    }
 
-    virtual void invoke(logrec_t& /*r*/)
+    size_t fileCount = 0;
+    in >> fileCount;
+    for (size_t i = 0; i < fileCount; i++) {
+        FileStats f;
+        size_t length = 0;
+        in >> length;
+        // skip the separator before the name
+        in.get();
+        f.name.resize(length);
+        in.read(&f.name[0], length);
+        in >> f.count >> f.bytes;
+        files.push_back(f);
+    }
+    if (in.fail()) {
+        throw runtime_error("Invalid log statistics in cursor file");
+    }
+}
+
+void LogStatsHandler::mergeCounters(const Counters& other)
+{
+    for (size_t t = 0; t < logrec_t::t_max_logrec; t++) {
+        counters.count[t] += other.count[t];
+        counters.bytes[t] += other.bytes[t];
+        for (size_t b = 0; b < HIST_BUCKETS; b++) {
+            counters.sizeHist[t][b] += other.sizeHist[t][b];
+        }
+    }
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        counters.xctHist[b] += other.xctHist[b];
+    }
+    counters.xctCount += other.xctCount;
+    counters.xctMax = std::max(counters.xctMax, other.xctMax);
+}
+
+void LogStatsHandler::finalize()
+{
+    flushAllXcts();
+
+    uint64_t totalCount = 0, totalBytes = 0;
+    for (size_t t = 0; t < logrec_t::t_max_logrec; t++) {
+        totalCount += counters.count[t];
+        totalBytes += counters.bytes[t];
+    }
+
+    cout << "LOGREC TYPES" << endl;
+    for (size_t t = 0; t < logrec_t::t_max_logrec; t++) {
+        if (counters.count[t] == 0) { continue; }
+
+        cout << "type=" << logrec_t::get_type_str((logrec_t::kind_t) t)
+            << " count=" << counters.count[t]
+            << " bytes=" << counters.bytes[t]
+            << " avg_size=" << counters.bytes[t] / counters.count[t]
+            << " size_hist=";
+        // bucket b counts sizes in [2^b, 2^(b+1))
+        for (size_t b = 0; b < HIST_BUCKETS; b++) {
+            cout << (b > 0 ? "," : "") << counters.sizeHist[t][b];
+        }
+        cout << "\n";
+    }
+    cout << "total_count=" << totalCount
+        << " total_bytes=" << totalBytes
+        << " avg_size=" << (totalCount > 0 ? totalBytes / totalCount : 0)
+        << endl;
+
+    cout << "TRANSACTIONS" << endl;
+    cout << "xct_count=" << counters.xctCount
+        << " max_logrecs=" << counters.xctMax
+        << " logrecs_hist=";
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        cout << (b > 0 ? "," : "") << counters.xctHist[b];
+    }
+    cout << endl;
+
+    cout << (isArchive ? "RUNS" : "PARTITIONS") << endl;
+    for (size_t i = 0; i < files.size(); i++) {
+        cout << "file=" << files[i].name
+            << " count=" << files[i].count
+            << " bytes=" << files[i].bytes
+            << "\n";
+    }
+    cout << flush;
+}
+
+static size_t blockEndOffset(const vector<size_t>& offsets, size_t b,
+        size_t dataEnd)
+{
+    return b + 1 < offsets.size() ? offsets[b + 1] : dataEnd;
+}
+
+/*
+ * In the contiguous run format, block headers are stripped when a block is
+ * appended to the run file, so blocks are delimited only by the offsets in
+ * the archive index. Data blocks are followed by the serialized index blocks,
+ * which take a full block each. The data area is read in large sequential
+ * chunks, each one holding as many whole blocks as fit.
+ */
+void LogStats::dumpRunBlocks(LogArchiver::ArchiveDirectory& dir,
+        const string& fname, size_t runNumber, size_t blockSize)
+{
+    lsn_t runBegin = LogArchiver::ArchiveDirectory::parseLSN(fname.c_str(),
+            false);
+    vector<size_t> offsets;
+    vector<lpid_t> firstPIDs;
+    if (!IndexInspector::getRunBlocks(dir.getIndex(), runBegin, offsets,
+                firstPIDs))
     {
-        // TODO implement interesting stats such as
-        // avg logrec size
-        // number of logrecs
-        // histogram (of count and size) of logrec types
+        throw runtime_error("Run not found in archive index: " + fname);
+    }
+
+    string path = logdir + "/" + fname;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Could not open run file " + path);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    size_t indexBlocks = 0, dataBlocks = 0;
+    W_COERCE(dir.getIndex()->getBlockCounts(fd, &indexBlocks, &dataBlocks));
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw runtime_error("Could not stat run file " + path);
     }
+    size_t dataEnd = st.st_size - indexBlocks * blockSize;
 
-    virtual void finalize() {};
-};
+    size_t bufferSize = std::max(READ_SIZE, blockSize);
+    char* buffer = new char[bufferSize];
+
+    size_t b = 0;
+    while (b < offsets.size()) {
+        // read as many whole blocks as fit into the buffer
+        size_t chunkBegin = offsets[b];
+        size_t last = b;
+        while (last + 1 < offsets.size() &&
+                blockEndOffset(offsets, last + 1, dataEnd) - chunkBegin
+                    <= bufferSize)
+        {
+            last++;
+        }
+        size_t chunkEnd = std::min(blockEndOffset(offsets, last, dataEnd),
+                chunkBegin + bufferSize);
+
+        size_t length = chunkEnd - chunkBegin;
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = ::pread(fd, buffer + done, length - done,
+                    chunkBegin + done);
+            if (n <= 0) {
+                delete[] buffer;
+                ::close(fd);
+                throw runtime_error("Error reading run file " + path);
+            }
+            done += n;
+        }
+
+        for (; b <= last; b++) {
+            size_t bpos = offsets[b] - chunkBegin;
+            size_t blockEnd = std::min(
+                    blockEndOffset(offsets, b, dataEnd) - chunkBegin, length);
+
+            lpid_t lastPID = lpid_t::null;
+            size_t pidCount = 0, lrCount = 0;
+            size_t bytes = blockEnd - bpos;
+
+            while (bpos < blockEnd) {
+                logrec_t* lr = (logrec_t*) (buffer + bpos);
+                w_assert1(lr->valid_header(lr->lsn_ck()));
+                if (lr->length() == 0) { break; }
+
+                if (lr->pid() != lastPID) {
+                    pidCount++;
+                    lastPID = lr->pid();
+                }
+                lrCount++;
+                bpos += lr->length();
+            }
+            w_assert1(lrCount == 0 || firstPIDs[b] == lpid_t::null ||
+                    ((logrec_t*) (buffer + offsets[b] - chunkBegin))->pid()
+                        == firstPIDs[b]);
+
+            cout << "run " << runNumber
+                << " block " << b
+                << " logrecs " << lrCount
+                << " bytes " << bytes
+                << " pids " << pidCount
+                << " fill " << (double) bytes / blockSize
+                << " density " << (pidCount > 0 ?
+                        (double) lrCount / pidCount : 0)
+                << "\n";
+        }
+    }
+
+    if (dataBlocks != offsets.size()) {
+        cerr << "Warning: run " << fname << " has " << dataBlocks
+            << " data blocks but " << offsets.size() << " index entries"
+            << endl;
+    }
+
+    delete[] buffer;
+    ::close(fd);
+}
 
 void LogStats::setupOptions()
 {
@@ -36,6 +416,8 @@ void LogStats::run()
     LogStatsHandler* h = new LogStatsHandler(isArchive);
     BaseScanner* s = getScanner();
 
+    s->openFileCallback = std::bind(&LogStatsHandler::newFile, h,
+            std::placeholders::_1);
     s->any_handlers.push_back(h);
     s->fork();
     s->join();
@@ -44,79 +426,24 @@ void LogStats::run()
     delete h;
 
     if (isArchive) {
-        // Gather physical stats of each run file
-        vector<string> files;
-
-        // TODO assuming default block size
-        LogArchiver::ArchiveDirectory dir(logdir,
-                LogArchiver::DFT_BLOCK_SIZE);
+        size_t blockSize = optionValues["sm_archiver_block_size"].as<int>();
+        LogArchiver::ArchiveDirectory dir(logdir, blockSize);
 
-        if (filename.empty()) {
-            dir.listFiles(files);
-        }
-        else {
-            files.push_back(filename);
-        }
-
-        // buffer for log archive blocks
-        char buffer[LogArchiver::DFT_BLOCK_SIZE];
-        int fd = -1;
-        size_t fpos = 0;
-        size_t currRun = 0;
-        size_t blockCount = 0;
-        size_t indexBlockCount = 0;
-        size_t bpos = 0;
-        size_t blockEnd = 0;
-        logrec_t* lr = NULL;
-        lpid_t lastPID = lpid_t::null;
-        size_t currBlock = 0;
-        size_t pidCount = 0;
-
-        int flags = smthread_t::OPEN_RDONLY;
-
-#if 0 // CS TODO: does not work with new archive contiguous format
         if (!indexOnly) {
-            for (size_t i = 0; i < files.size(); i++) {
-                W_COERCE(me()->open((logdir + "/" + files[i]).c_str(),
-                            flags, 0744, fd));
-                fpos = 0;
-                currBlock = 0;
-
-                W_COERCE(dir.getIndex()->getBlockCounts(fd, &indexBlockCount,
-                            &blockCount));
-
-                while(currBlock < blockCount) {
-                    dir.readBlock(fd, buffer, fpos);
-                    if (fpos == 0) { break; }
-
-                    bpos = sizeof(LogArchiver::BlockAssembly::BlockHeader);
-                    blockEnd = LogArchiver::BlockAssembly::getEndOfBlock(buffer);
-                    lastPID = lpid_t::null;
-                    pidCount = 0;
-
-                    while (bpos < blockEnd) {
-                        lr = (logrec_t*) (buffer + bpos);
-                        w_assert1(lr->valid_header(lr->lsn_ck()));
-
-                        if (lr->pid() != lastPID) {
-                            pidCount++;
-                            lastPID = lr->pid();
-                        }
-
-                        bpos += lr->length();
-                    }
-
-                    cout << "run=" << currRun << " block=" << currBlock
-                        << " pids=" << pidCount << endl;
-
-                    currBlock++;
-                }
+            vector<string> files;
+            if (filename.empty()) {
+                dir.listFiles(files);
+                std::sort(files.begin(), files.end(), runCompare);
+            }
+            else {
+                files.push_back(filename);
+            }
 
-                W_COERCE(me()->close(fd));
-                currRun++;
+            cout << "BLOCK INFO" << endl;
+            for (size_t i = 0; i < files.size(); i++) {
+                dumpRunBlocks(dir, files[i], i, blockSize);
             }
         }
-#endif
 
         cout << "INDEX INFO" << endl;
 
@@ -2,6 +2,9 @@
 #define LOGSTATS_H
 
 #include "command.h"
+#include "handler.h"
+
+#include <map>
 
 class LogStats : public LogScannerCommand {
 public:
@@ -11,6 +14,79 @@ public:
 
 protected:
     bool indexOnly;
+
+    /// Size of the sequential reads used to scan run files
+    static const size_t READ_SIZE = 16 * 1024 * 1024;
+
+    /// Prints physical statistics of each data block of the given run file
+    void dumpRunBlocks(LogArchiver::ArchiveDirectory& dir,
+            const string& fname, size_t runNumber, size_t blockSize);
+};
+
+/*
+ * Computes in a single pass the number of log records and their volume per
+ * log record type, a log-scale size histogram per type, a histogram of the
+ * number of log records per transaction, and totals per scanned file
+ * (partition or run). All counters on the hot path are fixed-size arrays.
+ *
+ * Open transactions are counted in a direct-mapped table indexed by TID. A
+ * transaction whose slot is taken by another open transaction is counted
+ * in an overflow map instead. Transactions are closed by their end or abort
+ * record, or by the end of the scan.
+ */
+class LogStatsHandler : public Handler
+{
+public:
+    static const size_t HIST_BUCKETS = 24;
+    static const size_t XCT_SLOTS = 1 << 20;
+
+    struct Counters {
+        uint64_t count[logrec_t::t_max_logrec];
+        uint64_t bytes[logrec_t::t_max_logrec];
+        uint64_t sizeHist[logrec_t::t_max_logrec][HIST_BUCKETS];
+        uint64_t xctHist[HIST_BUCKETS];
+        uint64_t xctCount;
+        uint64_t xctMax;
+    };
+
+    LogStatsHandler(bool isArchive);
+    virtual ~LogStatsHandler() {}
+
+    virtual void invoke(logrec_t& r);
+    virtual void invokeBatch(logrec_t** recs, size_t n);
+    virtual void finalize();
+    virtual void newFile(const char* fname);
+    virtual Handler* clone();
+    virtual void merge(Handler* clone);
+    virtual void saveState(std::ostream& out);
+    virtual void loadState(std::istream& in);
+
+private:
+    struct XctSlot {
+        uint64_t tid;
+        uint64_t count;
+        XctSlot() : tid(0), count(0) {}
+    };
+
+    struct FileStats {
+        string name;
+        uint64_t count;
+        uint64_t bytes;
+    };
+
+    bool isArchive;
+    Counters counters;
+    std::vector<XctSlot> xctSlots;
+    std::map<uint64_t, uint64_t> xctOverflow;
+    std::vector<FileStats> files;
+
+    void count(logrec_t& r);
+    void countXct(uint64_t tid, bool end);
+    void flushXct(XctSlot& slot);
+    void addXct(uint64_t logrecs);
+    void flushAllXcts();
+    // Adds the counters of a clone
+    void mergeCounters(const Counters& other);
 };
 
 #endif
@@ -6,12 +6,20 @@
 void VerifyLog::setupOptions()
 {
     LogScannerCommand::setupOptions();
+    options.add_options()
+        ("max-errors", po::value<size_t>(&maxErrors)->default_value(1000),
+            "Maximum number of violations to report in detail (0 for all)")
+    ;
 }
 
 void VerifyLog::run()
 {
+    if (unordered) {
+        throw runtime_error("Record order cannot be verified with --unordered");
+    }
+
     BaseScanner* s = getScanner();
-    VerifyHandler* h = new VerifyHandler(merge);
+    VerifyHandler* h = new VerifyHandler(merge, isArchive, maxErrors);
     if (!merge) {
         s->openFileCallback = std::bind(&VerifyHandler::newFile, h,
             std::placeholders::_1);
@@ -24,31 +32,97 @@ void VerifyLog::run()
     delete s;
 }
 
-VerifyHandler::VerifyHandler(bool merge)
-    : minLSN(lsn_t::null), maxLSN(lsn_t::null), lastLSN(lsn_t::null),
-    lastPID(lpid_t::null), count(0), merge(merge)
+VerifyHandler::VerifyHandler(bool merge, bool isArchive, size_t maxErrors)
+    : checkBounds(false), minLSN(lsn_t::null), maxLSN(lsn_t::null),
+    lastLSN(lsn_t::null), lastPID(lpid_t::null), count(0), mergeScan(merge),
+    isArchive(isArchive), maxErrors(maxErrors), violationCount(0)
+{
+}
+
+Handler* VerifyHandler::clone()
 {
+    return new VerifyHandler(mergeScan, isArchive, maxErrors);
+}
+
+void VerifyHandler::merge(Handler* clone)
+{
+    VerifyHandler* other = dynamic_cast<VerifyHandler*>(clone);
+    w_assert0(other);
+
+    count += other->count;
+    violationCount += other->violationCount;
+    for (size_t i = 0; i < other->violations.size(); i++) {
+        if (maxErrors > 0 && violations.size() >= maxErrors) { break; }
+        violations.push_back(other->violations[i]);
+    }
 }
 
 void VerifyHandler::newFile(const char* fname)
 {
-    minLSN = LogArchiver::ArchiveDirectory::parseLSN(fname, false);
-    maxLSN = LogArchiver::ArchiveDirectory::parseLSN(fname, true);
+    currentFile = fname;
+    checkBounds = true;
     lastLSN = lsn_t::null;
     lastPID = lpid_t::null;
+
+    if (isArchive) {
+        minLSN = LogArchiver::ArchiveDirectory::parseLSN(fname, false);
+        maxLSN = LogArchiver::ArchiveDirectory::parseLSN(fname, true);
+    }
+    else {
+        // log partitions are named log.<partition>
+        const char* dot = strrchr(fname, '.');
+        uint32_t p = dot ? strtoul(dot + 1, NULL, 10) : 0;
+        minLSN = lsn_t(p, 0);
+        maxLSN = lsn_t(p + 1, 0);
+    }
+}
+
+void VerifyHandler::addViolation(logrec_t& r, const string& error)
+{
+    violationCount++;
+    if (maxErrors > 0 && violations.size() >= maxErrors) {
+        return;
+    }
+
+    Violation v;
+    v.file = currentFile;
+    v.offset = isArchive || mergeScan ? 0 : r.lsn_ck().lo();
+    v.lsn = r.lsn_ck();
+    v.pid = r.pid();
+    v.error = error;
+    violations.push_back(v);
 }
 
 void VerifyHandler::invoke(logrec_t& r)
 {
     lsn_t lsn = r.lsn_ck();
     lpid_t pid = r.pid();
-    assert(r.valid_header());
-    assert(pid >= lastPID);
-    if (pid == lastPID) {
-        assert(lsn > lastLSN);
+
+    if (!r.valid_header(lsn)) {
+        addViolation(r, "invalid_header");
+    }
+
+    if (isArchive || mergeScan) {
+        if (pid < lastPID) {
+            addViolation(r, "pid_order");
+        }
+        else if (pid == lastPID && lsn <= lastLSN) {
+            addViolation(r, "lsn_order_within_pid");
+        }
+    }
+    else if (lsn <= lastLSN) {
+        addViolation(r, "lsn_order");
+    }
+
+    if (!mergeScan && checkBounds) {
+        if (lsn < minLSN) {
+            addViolation(r, "lsn_below_file_begin");
+        }
+        // archive run boundaries are inclusive
+        if (isArchive ? lsn > maxLSN : lsn >= maxLSN) {
+            addViolation(r, "lsn_above_file_end");
+        }
     }
-    assert(merge || lsn >= minLSN);
-    assert(merge || lsn <= maxLSN);
 
     lastLSN = lsn;
     lastPID = pid;
@@ -58,6 +132,36 @@ void VerifyHandler::invoke(logrec_t& r)
 
 void VerifyHandler::finalize()
 {
+    double elapsed = timer.time();
+
+    std::sort(violations.begin(), violations.end(),
+            [] (const Violation& a, const Violation& b) {
+                if (a.file != b.file) { return a.file < b.file; }
+                if (a.offset != b.offset) { return a.offset < b.offset; }
+                if (a.pid != b.pid) { return a.pid < b.pid; }
+                return a.lsn < b.lsn;
+            });
+
+    for (size_t i = 0; i < violations.size(); i++) {
+        const Violation& v = violations[i];
+        cout << "violation file=" << v.file;
+        if (!isArchive && !mergeScan) {
+            cout << " offset=" << v.offset;
+        }
+        cout << " lsn=" << v.lsn
+            << " pid=" << v.pid
+            << " error=" << v.error
+            << "\n";
+    }
+    if (violations.size() < violationCount) {
+        cout << "(" << violationCount - violations.size()
+            << " more violations not shown)" << endl;
+    }
+
     cout << "Log verification complete!" << endl;
-    cout << "scanned_logrecs " << count << flushl;
+    cout << "scanned_logrecs " << count << endl;
+    cout << "violations " << violationCount << endl;
+    cout << "elapsed_sec " << elapsed << endl;
+    cout << "logrecs_per_sec " << (elapsed > 0 ? count / elapsed : 0)
+        << flushl;
 }
@@ -3,29 +3,68 @@
 
 #include "command.h"
 #include "handler.h"
+#include "util/stopwatch.h"
 
 class VerifyLog : public LogScannerCommand
 {
 public:
     void setupOptions();
     void run();
+
+protected:
+    size_t maxErrors;
 };
 
+/*
+ * Checks that each log record has a valid header and that records appear in
+ * the expected order: by PID and then LSN in the log archive or in a merged
+ * scan, and by LSN within the bounds of the file otherwise. Instead of
+ * stopping at the first problem, every violation is recorded and reported
+ * at the end, followed by a summary.
+ */
 class VerifyHandler : public Handler {
 public:
-    VerifyHandler(bool merge);
+    struct Violation {
+        string file;
+        // offset of the record in its log partition; records of archive
+        // runs are identified by PID and LSN only
+        size_t offset;
+        lsn_t lsn;
+        lpid_t pid;
+        string error;
+    };
+
+    VerifyHandler(bool merge, bool isArchive, size_t maxErrors = 0);
     virtual ~VerifyHandler() {};
 
     virtual void invoke(logrec_t& r);
     virtual void finalize();
     virtual void newFile(const char* fname);
+    virtual Handler* clone();
+    virtual void merge(Handler* clone);
+
+    size_t getViolationCount() const { return violationCount; }
 private:
+    // LSN bounds of the current file, if known
+    bool checkBounds;
     lsn_t minLSN;
     lsn_t maxLSN;
     lsn_t lastLSN;
     lpid_t lastPID;
     long count;
-    bool merge;
-};;
+    bool mergeScan;
+    bool isArchive;
+
+    string currentFile;
+
+    // only the first maxErrors violations are kept (0 for all)
+    size_t maxErrors;
+    size_t violationCount;
+    std::vector<Violation> violations;
+
+    stopwatch_t timer;
+
+    void addViolation(logrec_t& r, const string& error);
+};
 
 #endif
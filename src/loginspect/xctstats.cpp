@@ -0,0 +1,153 @@
+#include "xctstats.h"
+#include "helpers.h"
+
+#include <algorithm>
+
+void XctStats::setupOptions()
+{
+    LogScannerCommand::setupOptions();
+}
+
+void XctStats::run()
+{
+    XctStatsHandler* h = new XctStatsHandler();
+    BaseScanner* s = getScanner();
+
+    // ticks have no transaction, but are needed for durations, so the
+    // handler sees all records and filters them itself
+    s->any_handlers.push_back(h);
+
+    s->fork();
+    s->join();
+
+    delete s;
+    delete h;
+}
+
+XctStatsHandler::Distribution::Distribution()
+    : count(0), sum(0), max(0)
+{
+    memset(hist, 0, sizeof(hist));
+}
+
+void XctStatsHandler::Distribution::add(uint64_t value)
+{
+    hist[log2Bucket(value, HIST_BUCKETS)]++;
+    count++;
+    sum += value;
+    if (value > max) { max = value; }
+}
+
+uint64_t XctStatsHandler::Distribution::percentile(double p) const
+{
+    uint64_t rank = p * count;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank) {
+            return std::min(max, ((uint64_t) 2 << b) - 1);
+        }
+    }
+    return max;
+}
+
+void XctStatsHandler::Distribution::print(const char* name) const
+{
+    cout << name
+        << " avg=" << (count > 0 ? (double) sum / count : 0)
+        << " p50=" << percentile(0.5)
+        << " p90=" << percentile(0.9)
+        << " p99=" << percentile(0.99)
+        << " max=" << max
+        << " hist=";
+    // bucket b counts values in [2^b, 2^(b+1))
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        cout << (b > 0 ? "," : "") << hist[b];
+    }
+    cout << "\n";
+}
+
+XctStatsHandler::XctStatsHandler()
+    : xcts(XCT_SLOTS), currentTick(0), incomplete(0), ssxLogrecs(0)
+{
+}
+
+void XctStatsHandler::invoke(logrec_t& r)
+{
+    logrec_t::kind_t type = r.type();
+    if (type == logrec_t::t_tick_sec || type == logrec_t::t_tick_msec) {
+        currentTick++;
+        return;
+    }
+
+    if (r.tid() == tid_t::null) {
+        // single-log system transaction, or no transaction at all
+        if (r.is_single_sys_xct()) {
+            ssxLogrecs++;
+        }
+        return;
+    }
+
+    uint64_t tid = r.tid().as_int64();
+    XctEntry& x = xcts[tid % XCT_SLOTS];
+    if (x.tid != tid) {
+        if (x.tid != 0) {
+            incomplete++;
+        }
+        x.tid = tid;
+        x.logrecs = 0;
+        x.bytes = 0;
+        x.beginTick = currentTick;
+        x.pages.clear();
+    }
+
+    x.logrecs++;
+    x.bytes += r.length();
+    if (!r.null_pid()) {
+        x.pages.push_back(r.pid());
+    }
+
+    if (type == logrec_t::t_xct_end) {
+        endXct(x, COMMITTED);
+    }
+    else if (type == logrec_t::t_xct_abort) {
+        endXct(x, ABORTED);
+    }
+}
+
+void XctStatsHandler::endXct(XctEntry& x, Outcome outcome)
+{
+    std::sort(x.pages.begin(), x.pages.end());
+    size_t distinctPages =
+        std::unique(x.pages.begin(), x.pages.end()) - x.pages.begin();
+
+    logrecs[outcome].add(x.logrecs);
+    bytes[outcome].add(x.bytes);
+    duration[outcome].add(currentTick - x.beginTick);
+    pages[outcome].add(distinctPages);
+
+    x.tid = 0;
+    x.pages.clear();
+}
+
+void XctStatsHandler::finalize()
+{
+    for (size_t i = 0; i < xcts.size(); i++) {
+        if (xcts[i].tid != 0) {
+            incomplete++;
+        }
+    }
+
+    const char* names[OUTCOMES] = { "COMMITTED", "ABORTED" };
+    for (int o = 0; o < OUTCOMES; o++) {
+        cout << names[o] << " xcts=" << logrecs[o].count << endl;
+        if (logrecs[o].count == 0) { continue; }
+        logrecs[o].print("logrecs");
+        bytes[o].print("bytes");
+        duration[o].print("ticks");
+        pages[o].print("pages");
+    }
+
+    cout << "incomplete_xcts=" << incomplete << endl;
+    cout << "ssx_logrecs=" << ssxLogrecs << endl;
+}
@@ -0,0 +1,75 @@
+#ifndef XCTSTATS_H
+#define XCTSTATS_H
+
+#include "command.h"
+#include "handler.h"
+
+class XctStats : public LogScannerCommand {
+public:
+    void run();
+    void setupOptions();
+};
+
+/*
+ * Reconstructs transactions from their log records and reports the
+ * distribution of log records, log volume, duration in ticks and number of
+ * distinct pages per transaction, separately for committed and aborted
+ * transactions. Since there is no log record for the beginning of a
+ * transaction, the first record with a given TID marks its beginning.
+ *
+ * Active transactions are kept in a table indexed by TID modulo its size.
+ * As TIDs are assigned in increasing order, an entry is only reused by a
+ * transaction started much later; the previous one, if it was not ended by
+ * then, is counted as incomplete, like those still active at the end of
+ * the log.
+ */
+class XctStatsHandler : public Handler {
+public:
+    static const size_t HIST_BUCKETS = 32;
+    static const size_t XCT_SLOTS = 1 << 16;
+
+    struct Distribution {
+        uint64_t hist[HIST_BUCKETS];
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+
+        Distribution();
+        void add(uint64_t value);
+        // upper bound of the histogram bucket containing the percentile
+        uint64_t percentile(double p) const;
+        void print(const char* name) const;
+    };
+
+    XctStatsHandler();
+    virtual ~XctStatsHandler() {}
+
+    virtual void invoke(logrec_t& r);
+    virtual void finalize();
+
+private:
+    struct XctEntry {
+        uint64_t tid;
+        uint64_t logrecs;
+        uint64_t bytes;
+        long beginTick;
+        std::vector<lpid_t> pages;
+        XctEntry() : tid(0), logrecs(0), bytes(0), beginTick(0) {}
+    };
+
+    enum Outcome { COMMITTED = 0, ABORTED = 1, OUTCOMES = 2 };
+
+    std::vector<XctEntry> xcts;
+    long currentTick;
+    uint64_t incomplete;
+    uint64_t ssxLogrecs;
+
+    Distribution logrecs[OUTCOMES];
+    Distribution bytes[OUTCOMES];
+    Distribution duration[OUTCOMES];
+    Distribution pages[OUTCOMES];
+
+    void endXct(XctEntry& x, Outcome outcome);
+};
+
+#endif
@@ -1,6 +1,10 @@
 #include "genarchive.h"
+#include "runcodec.h"
+#include "runfilter.h"
+#include "util/stopwatch.h"
 
 #include <fstream>
+#include <sys/stat.h>
 
 void GenArchive::setupOptions()
 {
@@ -14,9 +18,50 @@ void GenArchive::setupOptions()
             "Directory where the archive runs will be stored (must exist)")
         ("maxLogSize,m", po::value<long>(&maxLogSize)->default_value(m),
             "max_logsize parameter of Shore-MT (default should be fine)")
+        ("workspace,w", po::value<size_t>(&workspaceSize)
+            ->default_value(256 * 1024 * 1024),
+            "Size in bytes of the sort workspace, which determines the size \
+            of the generated runs (at least 3 blocks)")
+        ("block-size,b", po::value<size_t>(&blockSize)
+            ->default_value(LogArchiver::DFT_BLOCK_SIZE),
+            "Size in bytes of archive blocks; must match \
+            sm_archiver_block_size of the commands reading the archive")
+        ("compress", po::value<bool>(&compress)->default_value(false)
+            ->implicit_value(true),
+            "Also write compressed copies of the generated runs, which are \
+            read instead by scans of the log archive (see RunCodec)")
+        ("filter-bits", po::value<size_t>(&filterBits)->default_value(0),
+            "Bits per page of the PID filters built for the generated runs, \
+            which let scans of a few pages skip runs (0 for no filters)")
     ;
 }
 
+/*
+ * Total size of the log partitions up to the given LSN
+ */
+size_t GenArchive::getLogVolume(lsn_t endLSN)
+{
+    std::vector<int> partitions;
+    BlockScanner::listPartitions(logdir, partitions);
+
+    size_t total = 0;
+    for (size_t i = 0; i < partitions.size(); i++) {
+        if (partitions[i] > (int) endLSN.hi()) { break; }
+        if (partitions[i] == (int) endLSN.hi()) {
+            total += endLSN.lo();
+            break;
+        }
+
+        stringstream fname;
+        fname << logdir << "/log." << partitions[i];
+        struct stat st;
+        if (::stat(fname.str().c_str(), &st) == 0) {
+            total += st.st_size;
+        }
+    }
+    return total;
+}
+
 void GenArchive::run()
 {
     // check if directory exists
@@ -34,8 +79,10 @@ void GenArchive::run()
      * and if it already exists, check if there are any files in it
      */
 
-    const size_t blockSize = 8192;
-    const size_t workspaceSize = 3 * blockSize;
+    // reader, sorter and writer each need at least one block
+    if (workspaceSize < 3 * blockSize) {
+        throw runtime_error("Workspace must hold at least 3 blocks");
+    }
 
     start_base();
     start_io();
@@ -45,6 +92,8 @@ void GenArchive::run()
     lsn_t durableLSN = smlevel_0::log->durable_lsn();
     cerr << "Activating log archiver until LSN " << durableLSN << endl;
 
+    stopwatch_t timer;
+
     smlevel_0::logArchiver->fork();
 
     // wait for all log to be archived
@@ -57,6 +106,22 @@ void GenArchive::run()
     smlevel_0::logArchiver->shutdown();
     smlevel_0::logArchiver->join();
 
+    double elapsed = timer.time();
+    size_t logBytes = getLogVolume(durableLSN);
+    cerr << "Archived " << logBytes << " bytes of log in " << elapsed
+        << " sec (" << (elapsed > 0 ? logBytes / elapsed / 1048576 : 0)
+        << " MB/s)" << endl;
+
+    if (compress || filterBits > 0) {
+        LogArchiver::ArchiveDirectory dir(archdir, blockSize);
+        if (compress) {
+            RunCodec::compressDirectory(dir);
+        }
+        if (filterBits > 0) {
+            RunFilter::buildDirectory(dir, filterBits);
+        }
+    }
+
     smlevel_0::operating_mode = smlevel_0::t_in_redo;
     smlevel_0::logging_enabled = false;
 }
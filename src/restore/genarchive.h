@@ -12,6 +12,12 @@ private:
     string logdir;
     string archdir;
     long maxLogSize;
+    size_t workspaceSize;
+    size_t blockSize;
+    bool compress;
+    size_t filterBits;
+
+    size_t getLogVolume(lsn_t endLSN);
 };
 
 #endif
@@ -1,15 +1,18 @@
 #include "mergeruns.h"
 
+#include "helpers.h"
 #include "logarchiver.h"
+#include "runcodec.h"
+#include "runfilter.h"
+#include "util/stopwatch.h"
+
+#include <atomic>
+#include <exception>
 
 #define BOOST_FILESYSTEM_NO_DEPRECATED
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
 
-// CS TODO: LA metadata -- should be serialized on run files
-const size_t BLOCK_SIZE = 1048576;
-const size_t BUCKET_SIZE = 128;
-
 void MergeRuns::setupOptions()
 {
     options.add_options()
@@ -18,39 +21,558 @@ void MergeRuns::setupOptions()
         ("outdir", po::value<string>(&outdir)->default_value(""),
             "Directory where the merged runs will be stored (empty for same as indir)")
         ("minRunSize", po::value<size_t>(&minRunSize)->default_value(0),
-            "Minimum size of a merged run (0 for any)")
+            "Minimum size of a run to be merged (0 for any)")
         ("maxRunSize", po::value<size_t>(&maxRunSize)->default_value(0),
-            "Maximum size of a merged run (0 for any)")
+            "Maximum size of a run to be merged (0 for any)")
         ("fanin", po::value<size_t>(&fanin)->required(),
-            "Merge fan-in (required, larger than 1)")
+            "Merge fan-in, i.e., maximum number of runs merged into one \
+            (required, larger than 1)")
+        ("levels", po::value<size_t>(&levels)->default_value(1),
+            "Number of merge levels, each merging groups of fan-in \
+            consecutive runs (0 for as many as needed to get a single run)")
+        ("threads", po::value<size_t>(&threads)->default_value(1),
+            "Number of merge groups merged concurrently")
+        ("block-size", po::value<size_t>(&blockSize)
+            ->default_value(LogArchiver::DFT_BLOCK_SIZE),
+            "Block size of the log archive")
+        ("bucket-size", po::value<size_t>(&bucketSize)->default_value(128),
+            "Bucket size of the log archive index")
+        ("policy", po::value<string>(&policy)->default_value("fanin"),
+            "Which runs to merge: fanin (groups of fan-in consecutive runs), \
+            tiered (fan-in consecutive runs of similar size) or leveled \
+            (newer runs into older ones until these are size-ratio times \
+            larger)")
+        ("size-ratio", po::value<double>(&sizeRatio)->default_value(4),
+            "Size ratio between runs considered similar (tiered) or between \
+            consecutive levels (leveled)")
+        ("max-runs", po::value<size_t>(&maxRuns)->default_value(0),
+            "Target read amplification of restore, i.e., maximum number of \
+            runs left; if the policy leaves more, the cheapest groups of \
+            consecutive runs are also merged (0 for no target)")
+        ("dry-run", po::value<bool>(&dryRun)->default_value(false)
+            ->implicit_value(true),
+            "Print the merge plan with its estimated I/O without merging")
+        ("compress", po::value<bool>(&compress)->default_value(false)
+            ->implicit_value(true),
+            "Also write compressed copies of the resulting runs, which are \
+            read instead by scans of the log archive (see RunCodec)")
+        ("filter-bits", po::value<size_t>(&filterBits)->default_value(0),
+            "Bits per page of the PID filters built for the resulting runs, \
+            which let scans of a few pages skip runs (0 for no filters)")
     ;
 }
 
+/*
+ * Only runs which are adjacent in the LSN space may be merged, otherwise the
+ * merged run would cover a range of the log which is missing in the archive.
+ */
+bool MergeRuns::adjacent(const std::vector<RunInfo>& runs, size_t i)
+{
+    return runs[i - 1].end == runs[i].begin;
+}
+
+/*
+ * Runs outside the size limits are never merged, i.e., groups planned by
+ * the policies end before them.
+ */
+bool MergeRuns::mergeable(const RunInfo& run) const
+{
+    return run.bytes >= minRunSize &&
+        (maxRunSize == 0 || run.bytes <= maxRunSize);
+}
+
+size_t MergeRuns::rangeBytes(const std::vector<RunInfo>& runs, size_t first,
+        size_t last)
+{
+    size_t bytes = 0;
+    for (size_t i = first; i < last; i++) {
+        bytes += runs[i].bytes;
+    }
+    return bytes;
+}
+
+/*
+ * Merges the groups of one level, taking them from a shared queue. An
+ * exception ends the thread, which then takes no further groups, and is
+ * rethrown by mergeLevel once all threads are joined.
+ */
+class MergeGroupThread : public smthread_t {
+public:
+    MergeGroupThread(MergeRuns* cmd,
+            std::vector<MergeRuns::MergeGroup>& groups,
+            std::atomic<size_t>& next)
+        : smthread_t(t_regular, "MergeGroupThread"),
+        cmd(cmd), groups(groups), next(next)
+    {}
+
+    virtual void run()
+    {
+        try {
+            size_t g;
+            while ((g = next.fetch_add(1)) < groups.size()) {
+                cmd->mergeGroup(groups[g]);
+            }
+        }
+        catch (...) {
+            error = std::current_exception();
+            // let the other threads stop after their current group
+            next = groups.size();
+        }
+    }
+
+    std::exception_ptr error;
+
+private:
+    MergeRuns* cmd;
+    std::vector<MergeRuns::MergeGroup>& groups;
+    std::atomic<size_t>& next;
+};
+
+/*
+ * Each group is merged from a work directory of its own which contains hard
+ * links to the input runs, so that independent groups can be merged
+ * concurrently without sharing an ArchiveDirectory. Inputs in a different
+ * directory than the work directory, which may be on another device, are
+ * copied instead. The merged run is written into a work directory inside
+ * the output directory.
+ */
+void MergeRuns::mergeGroup(MergeGroup& group)
+{
+    stopwatch_t timer;
+
+    fs::create_directories(group.workdir);
+    fs::create_directories(group.outWorkdir);
+    group.bytes = 0;
+    fs::path workParent = fs::path(group.workdir).parent_path();
+    for (size_t i = 0; i < group.runs.size(); i++) {
+        fs::path src(group.runs[i]);
+        fs::path link = fs::path(group.workdir) / src.filename();
+        if (src.parent_path() == workParent) {
+            fs::create_hard_link(src, link);
+        }
+        else {
+            fs::copy_file(src, link);
+        }
+        group.bytes += fs::file_size(src);
+    }
+
+    {
+        LogArchiver::ArchiveDirectory in(group.workdir, blockSize,
+                bucketSize);
+        LogArchiver::ArchiveDirectory out(group.outWorkdir, blockSize,
+                bucketSize);
+        // size limits were already applied by the planner
+        LogArchiver::MergerDaemon merge(&in, &out);
+        rc_t rc = merge.runSync(group.runs.size(), 0, 0);
+        if (rc.is_error()) {
+            throw runtime_error("Could not merge runs in " + group.workdir
+                    + " (error " + std::to_string(rc.err_num()) + ")");
+        }
+    }
+
+    std::vector<string> files;
+    LogArchiver::ArchiveDirectory result(group.outWorkdir, blockSize,
+            bucketSize);
+    result.listFiles(files);
+    if (files.size() != 1) {
+        throw runtime_error("Merge into " + group.outWorkdir + " produced "
+                + std::to_string(files.size()) + " runs");
+    }
+    group.result = group.outWorkdir + "/" + files[0];
+    group.seconds = timer.time();
+}
+
+/*
+ * Plans which runs of the next level are merged. The policy proposes the
+ * groups and, if a target read amplification is given, the cheapest
+ * remaining groups are added until it is met.
+ */
+void MergeRuns::planLevel(const std::vector<RunInfo>& runs, MergePlan& plan)
+{
+    if (policy == "fanin") {
+        planFanin(runs, plan);
+    }
+    else if (policy == "tiered") {
+        planTiered(runs, plan);
+    }
+    else if (policy == "leveled") {
+        planLeveled(runs, plan);
+    }
+
+    if (maxRuns > 0) {
+        planReadAmp(runs, plan);
+    }
+    std::sort(plan.begin(), plan.end());
+}
+
+void MergeRuns::planFanin(const std::vector<RunInfo>& runs, MergePlan& plan)
+{
+    size_t i = 0;
+    while (i < runs.size()) {
+        if (!mergeable(runs[i])) {
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < runs.size() && j - i < fanin && adjacent(runs, j)
+                && mergeable(runs[j]))
+        {
+            j++;
+        }
+        if (j - i > 1) {
+            plan.push_back(std::make_pair(i, j));
+        }
+        i = j;
+    }
+}
+
+/*
+ * Like size-tiered compaction: fan-in consecutive runs whose sizes are
+ * within the size ratio of each other are merged, leaving runs of a
+ * different size until enough similar runs accumulate next to them.
+ */
+void MergeRuns::planTiered(const std::vector<RunInfo>& runs, MergePlan& plan)
+{
+    size_t i = 0;
+    while (i + fanin <= runs.size()) {
+        if (!mergeable(runs[i])) {
+            i++;
+            continue;
+        }
+        size_t lo = runs[i].bytes, hi = runs[i].bytes;
+        size_t j = i + 1;
+        while (j < runs.size() && j - i < fanin && adjacent(runs, j)
+                && mergeable(runs[j]))
+        {
+            size_t newLo = std::min(lo, runs[j].bytes);
+            size_t newHi = std::max(hi, runs[j].bytes);
+            if (newHi > sizeRatio * std::max<size_t>(newLo, 1)) { break; }
+            lo = newLo;
+            hi = newHi;
+            j++;
+        }
+        if (j - i == fanin) {
+            plan.push_back(std::make_pair(i, j));
+            i = j;
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+/*
+ * Like leveled compaction: starting from the newest run, older runs are
+ * merged with the newer ones as long as they are not size-ratio times
+ * larger than them, so that run sizes grow geometrically with their age and
+ * the number of runs is logarithmic in the size of the archive.
+ */
+void MergeRuns::planLeveled(const std::vector<RunInfo>& runs, MergePlan& plan)
+{
+    MergePlan reversed;
+    size_t last = runs.size();
+    while (last > 0) {
+        size_t first = last - 1;
+        size_t bytes = runs[first].bytes;
+        while (first > 0 && last - first < fanin && adjacent(runs, first)
+                && mergeable(runs[first]) && mergeable(runs[first - 1])
+                && runs[first - 1].bytes < sizeRatio * bytes)
+        {
+            first--;
+            bytes += runs[first].bytes;
+        }
+        if (last - first > 1) {
+            reversed.push_back(std::make_pair(first, last));
+        }
+        last = first;
+    }
+    plan.assign(reversed.rbegin(), reversed.rend());
+}
+
+/*
+ * Adds groups not overlapping the planned ones until at most max-runs runs
+ * are left, always picking the group of consecutive runs with the lowest
+ * cost, i.e., bytes merged per run eliminated.
+ */
+void MergeRuns::planReadAmp(const std::vector<RunInfo>& runs, MergePlan& plan)
+{
+    std::vector<bool> planned(runs.size(), false);
+    size_t left = runs.size();
+    for (size_t p = 0; p < plan.size(); p++) {
+        for (size_t i = plan[p].first; i < plan[p].second; i++) {
+            planned[i] = true;
+        }
+        left -= plan[p].second - plan[p].first - 1;
+    }
+
+    while (left > maxRuns) {
+        size_t excess = left - maxRuns;
+        double bestCost = 0;
+        size_t bestFirst = 0, bestLast = 0;
+        for (size_t i = 0; i < runs.size(); i++) {
+            if (planned[i] || !mergeable(runs[i])) { continue; }
+            size_t bytes = runs[i].bytes;
+            for (size_t j = i + 1; j < runs.size() && j - i < fanin
+                    && j - i <= excess; j++)
+            {
+                if (planned[j] || !adjacent(runs, j) || !mergeable(runs[j])) {
+                    break;
+                }
+                bytes += runs[j].bytes;
+                double cost = (double) bytes / (j - i);
+                if (bestLast == 0 || cost < bestCost) {
+                    bestCost = cost;
+                    bestFirst = i;
+                    bestLast = j + 1;
+                }
+            }
+        }
+        if (bestLast == 0) {
+            // remaining runs cannot be merged any further
+            break;
+        }
+
+        plan.push_back(std::make_pair(bestFirst, bestLast));
+        for (size_t i = bestFirst; i < bestLast; i++) {
+            planned[i] = true;
+        }
+        left -= bestLast - bestFirst - 1;
+    }
+}
+
+/*
+ * Merging a group reads all of its runs and writes about the same amount of
+ * data into the merged run.
+ */
+void MergeRuns::printPlan(size_t level, const std::vector<RunInfo>& runs,
+        const MergePlan& plan)
+{
+    for (size_t p = 0; p < plan.size(); p++) {
+        size_t bytes = rangeBytes(runs, plan[p].first, plan[p].second);
+        cout << "plan level=" << level
+            << " group=" << p
+            << " runs=" << plan[p].second - plan[p].first
+            << " begin=" << runs[plan[p].first].begin
+            << " end=" << runs[plan[p].second - 1].end
+            << " read=" << bytes
+            << " write=" << bytes
+            << endl;
+    }
+}
+
+void MergeRuns::applyPlan(std::vector<RunInfo>& runs, const MergePlan& plan)
+{
+    std::vector<RunInfo> next;
+    size_t p = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+        if (p < plan.size() && plan[p].first == i) {
+            RunInfo merged = runs[i];
+            merged.path = "";
+            merged.end = runs[plan[p].second - 1].end;
+            merged.bytes = rangeBytes(runs, plan[p].first, plan[p].second);
+            next.push_back(merged);
+            i = plan[p].second - 1;
+            p++;
+        }
+        else {
+            next.push_back(runs[i]);
+        }
+    }
+    runs.swap(next);
+}
+
+/*
+ * Merges the groups of runs of one level given by the plan, which are
+ * independent of each other. The runs are replaced by those of the next
+ * level, in LSN order.
+ */
+void MergeRuns::mergeLevel(size_t level, const string& dir,
+        std::vector<RunInfo>& runs, const MergePlan& plan)
+{
+    std::vector<MergeGroup> groups;
+    for (size_t p = 0; p < plan.size(); p++) {
+        MergeGroup group;
+        for (size_t i = plan[p].first; i < plan[p].second; i++) {
+            group.runs.push_back(runs[i].path);
+        }
+        string suffix = "/merge." + std::to_string(level) + "."
+            + std::to_string(p);
+        // a group mixing original runs with merged ones is merged in the
+        // output directory, copying the original runs
+        string parent = fs::path(group.runs[0]).parent_path().string();
+        for (size_t i = 1; i < group.runs.size(); i++) {
+            if (fs::path(group.runs[i]).parent_path() != parent) {
+                parent = dir;
+                break;
+            }
+        }
+        group.workdir = parent + suffix;
+        group.outWorkdir = dir + suffix + ".out";
+        group.bytes = 0;
+        group.seconds = 0;
+        groups.push_back(group);
+    }
+
+    std::atomic<size_t> nextGroup(0);
+    size_t workers = std::max<size_t>(1, std::min(threads, groups.size()));
+    std::vector<MergeGroupThread*> merges;
+    for (size_t i = 0; i < workers; i++) {
+        merges.push_back(new MergeGroupThread(this, groups, nextGroup));
+        merges[i]->fork();
+    }
+    std::exception_ptr error;
+    for (size_t i = 0; i < workers; i++) {
+        merges[i]->join();
+        if (!error) { error = merges[i]->error; }
+        delete merges[i];
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    // move merged runs into the output directory and remove the inputs,
+    // except for original runs if the output goes elsewhere; these may be
+    // merged at any level if they were left over by earlier levels
+    applyPlan(runs, plan);
+    size_t r = 0;
+    for (size_t g = 0; g < groups.size(); g++) {
+        MergeGroup& group = groups[g];
+        fs::path target = fs::path(dir) / fs::path(group.result).filename();
+        fs::rename(group.result, target);
+        for (size_t j = 0; j < group.runs.size(); j++) {
+            fs::path input(group.runs[j]);
+            if (dir == indir || input.parent_path() != fs::path(indir)) {
+                fs::remove(input);
+                fs::remove(input.parent_path()
+                        / (RunFilter::PREFIX + input.filename().string()));
+                fs::remove(input.parent_path()
+                        / (RunCodec::PREFIX + input.filename().string()));
+            }
+        }
+        fs::remove_all(group.workdir);
+        fs::remove_all(group.outWorkdir);
+
+        while (!runs[r].path.empty()) { r++; }
+        runs[r].path = target.string();
+        runs[r].bytes = fs::file_size(target);
+
+        cout << "level=" << level
+            << " runs=" << group.runs.size()
+            << " bytes=" << group.bytes
+            << " seconds=" << group.seconds
+            << " MB/s=" << (group.seconds > 0 ?
+                    group.bytes / group.seconds / 1048576 : 0)
+            << " output=" << target.filename().string()
+            << endl;
+    }
+}
+
 void MergeRuns::run()
 {
     if (fanin <= 1) {
         throw runtime_error("Invalid merge fan-in (must be > 1)");
     }
+    if (policy != "fanin" && policy != "tiered" && policy != "leveled") {
+        throw runtime_error("Invalid merge policy: " + policy);
+    }
+    if (sizeRatio < 1) {
+        throw runtime_error("Invalid size ratio (must be >= 1)");
+    }
 
-    LogArchiver::ArchiveDirectory* in =
-        new LogArchiver::ArchiveDirectory(indir, BLOCK_SIZE, BUCKET_SIZE);
-
-    LogArchiver::ArchiveDirectory* out = in;
+    string dir = indir;
     if (!outdir.empty() && outdir != indir) {
         // if directory does not exist, create it
         fs::path fspath(outdir);
-        if (!fs::exists(fspath)) {
+        if (!dryRun && !fs::exists(fspath)) {
             fs::create_directories(fspath);
         }
-        else {
+        else if (fs::exists(fspath)) {
             if (!fs::is_directory(fspath)) {
                 throw runtime_error("Provided path is not a directory!");
             }
         }
+        dir = outdir;
+    }
+
+    std::vector<string> files;
+    {
+        LogArchiver::ArchiveDirectory in(indir, blockSize, bucketSize);
+        in.listFiles(files);
+    }
+    std::sort(files.begin(), files.end(), runCompare);
+
+    std::vector<RunInfo> runs(files.size());
+    size_t totalBytes = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        runs[i].path = indir + "/" + files[i];
+        runs[i].begin =
+            LogArchiver::ArchiveDirectory::parseLSN(files[i].c_str(), false);
+        runs[i].end =
+            LogArchiver::ArchiveDirectory::parseLSN(files[i].c_str(), true);
+        runs[i].bytes = fs::file_size(runs[i].path);
+        totalBytes += runs[i].bytes;
+    }
+
+    size_t initialRuns = runs.size();
+    size_t totalIO = 0;
+    size_t level = 0;
+    for (; levels == 0 || level < levels; level++) {
+        MergePlan plan;
+        planLevel(runs, plan);
+        if (plan.empty()) { break; }
+
+        size_t before = runs.size();
+        size_t io = 0;
+        for (size_t p = 0; p < plan.size(); p++) {
+            io += 2 * rangeBytes(runs, plan[p].first, plan[p].second);
+        }
+        totalIO += io;
+
+        if (dryRun) {
+            printPlan(level, runs, plan);
+            applyPlan(runs, plan);
+        }
+        else {
+            mergeLevel(level, dir, runs, plan);
+        }
+
+        cout << "level=" << level
+            << " groups=" << plan.size()
+            << " runs_before=" << before
+            << " runs_after=" << runs.size()
+            << " io=" << io
+            << endl;
+    }
+
+    cout << "policy=" << policy
+        << " levels=" << level
+        << " runs_before=" << initialRuns
+        << " runs_after=" << runs.size()
+        << " archive_bytes=" << totalBytes
+        << " io=" << totalIO
+        << " io_per_byte=" << (totalBytes > 0 ?
+                (double) totalIO / totalBytes : 0)
+        << endl;
 
-        out = new LogArchiver::ArchiveDirectory(outdir, BLOCK_SIZE, BUCKET_SIZE);
+    if (dryRun) { return; }
+
+    // runs which were never merged are copied if the output goes elsewhere
+    if (dir != indir) {
+        for (size_t i = 0; i < runs.size(); i++) {
+            fs::path src(runs[i].path);
+            if (src.parent_path() == fs::path(indir)) {
+                fs::copy_file(src, fs::path(dir) / src.filename());
+            }
+        }
     }
 
-    LogArchiver::MergerDaemon merge(in, out);
-    W_COERCE(merge.runSync(fanin, minRunSize, maxRunSize));
+    if (compress || filterBits > 0) {
+        LogArchiver::ArchiveDirectory out(dir, blockSize, bucketSize);
+        if (compress) {
+            RunCodec::compressDirectory(out);
+        }
+        if (filterBits > 0) {
+            RunFilter::buildDirectory(out, filterBits);
+        }
+    }
 }
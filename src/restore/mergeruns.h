@@ -14,6 +14,58 @@ private:
     size_t minRunSize;
     size_t maxRunSize;
     size_t fanin;
+    size_t levels;
+    size_t threads;
+    size_t blockSize;
+    size_t bucketSize;
+    string policy;
+    double sizeRatio;
+    size_t maxRuns;
+    bool dryRun;
+    bool compress;
+    size_t filterBits;
+
+    struct RunInfo {
+        string path;
+        lsn_t begin;
+        lsn_t end;
+        size_t bytes;
+    };
+
+    // Half-open ranges of consecutive runs, each merged into a single run
+    typedef std::vector<std::pair<size_t, size_t>> MergePlan;
+
+    struct MergeGroup {
+        std::vector<string> runs;
+        // links to the input runs, on the same device as the inputs
+        string workdir;
+        // merge output, on the device of the output directory
+        string outWorkdir;
+        // set by the merge thread
+        string result;
+        size_t bytes;
+        double seconds;
+    };
+
+    void planLevel(const std::vector<RunInfo>& runs, MergePlan& plan);
+    void planFanin(const std::vector<RunInfo>& runs, MergePlan& plan);
+    void planTiered(const std::vector<RunInfo>& runs, MergePlan& plan);
+    void planLeveled(const std::vector<RunInfo>& runs, MergePlan& plan);
+    void planReadAmp(const std::vector<RunInfo>& runs, MergePlan& plan);
+    void printPlan(size_t level, const std::vector<RunInfo>& runs,
+            const MergePlan& plan);
+    static void applyPlan(std::vector<RunInfo>& runs, const MergePlan& plan);
+    static bool adjacent(const std::vector<RunInfo>& runs, size_t i);
+    bool mergeable(const RunInfo& run) const;
+    static size_t rangeBytes(const std::vector<RunInfo>& runs, size_t first,
+            size_t last);
+
+    void mergeLevel(size_t level, const string& dir,
+            std::vector<RunInfo>& runs, const MergePlan& plan);
+    void mergeGroup(MergeGroup& group);
+
+    friend class MergeGroupThread;
+    friend class MergePlanTest;
 };
 
 #endif
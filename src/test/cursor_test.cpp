@@ -0,0 +1,175 @@
+/*
+ * Test of incremental scans with --cursor on a live log partition. The log
+ * manager ends each flush with a skip log record, which the next flush
+ * overwrites with new records. A scan resumed from the cursor must start
+ * at that skip record, so that the records written over it are delivered
+ * exactly once.
+ */
+#include "command.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdlib.h>
+
+// records of the test log all have the same size
+const size_t REC_SIZE = 64;
+
+static size_t failures = 0;
+
+static void check(bool cond, const string& what)
+{
+    if (!cond) {
+        cerr << "FAILED: " << what << endl;
+        failures++;
+    }
+}
+
+/*
+ * Writes records of the given type at the given offsets of log partition 1.
+ * Record length and type are the first fields of the log record header, and
+ * the LSN is stored in the last bytes of each record (see lsn_ck()).
+ */
+static void writeRecords(const string& logdir, size_t offset, size_t count,
+        logrec_t::kind_t type)
+{
+    string fname = logdir + "/log.1";
+    std::fstream f(fname.c_str(), std::ios::in | std::ios::out
+            | std::ios::binary);
+    if (!f.is_open()) {
+        f.open(fname.c_str(), std::ios::out | std::ios::binary);
+    }
+
+    for (size_t i = 0; i < count; i++, offset += REC_SIZE) {
+        char rec[REC_SIZE];
+        memset(rec, 0, sizeof(rec));
+        uint16_t length = REC_SIZE;
+        memcpy(rec, &length, sizeof(length));
+        rec[sizeof(length)] = type;
+        lsn_t lsn(1, offset);
+        memcpy(rec + REC_SIZE - sizeof(lsn_t), &lsn, sizeof(lsn_t));
+
+        logrec_t* lr = (logrec_t*) rec;
+        check(lr->length() == REC_SIZE && lr->type() == type
+                && lr->lsn_ck() == lsn, "unexpected log record layout");
+
+        f.seekp(offset);
+        f.write(rec, REC_SIZE);
+    }
+    f.close();
+    check(!f.fail(), "could not write " + fname);
+}
+
+class CollectHandler : public Handler {
+public:
+    std::vector<lsn_t> lsns;
+    std::vector<logrec_t::kind_t> types;
+
+    virtual void invoke(logrec_t& r)
+    {
+        lsns.push_back(r.lsn_ck());
+        types.push_back(r.type());
+    }
+
+    virtual void finalize() {}
+};
+
+/*
+ * Scans the log with the options of the log scanner commands, collecting
+ * the delivered records.
+ */
+class CursorScan : public LogScannerCommand {
+public:
+    CollectHandler handler;
+
+    virtual void run()
+    {
+        BaseScanner* s = getScanner();
+        s->type_handlers.resize(logrec_t::t_max_logrec);
+        s->any_handlers.push_back(&handler);
+        s->fork();
+        s->join();
+        delete s;
+    }
+};
+
+static void scan(const string& logdir, const string& cursor,
+        CollectHandler& result)
+{
+    CursorScan* cmd = new CursorScan();
+    cmd->setupOptions();
+
+    string logdirArg = "--logdir=" + logdir;
+    string cursorArg = "--cursor=" + cursor;
+    const char* argv[] = { "cursor_test", logdirArg.c_str(),
+        cursorArg.c_str() };
+    po::variables_map vm;
+    po::store(po::parse_command_line(3, argv, cmd->getOptions()), vm);
+    po::notify(vm);
+    cmd->setOptionValues(vm);
+
+    cmd->fork();
+    cmd->join();
+    result = cmd->handler;
+    delete cmd;
+}
+
+int main()
+{
+    Command::init();
+
+    char dirTemplate[] = "/tmp/cursor_test.XXXXXX";
+    if (!mkdtemp(dirTemplate)) {
+        cerr << "Could not create temporary directory" << endl;
+        return 1;
+    }
+    string logdir = dirTemplate;
+    string cursor = logdir + "/cursor";
+
+    // first flush: three records followed by a skip record
+    writeRecords(logdir, 0, 3, logrec_t::t_tick_sec);
+    writeRecords(logdir, 3 * REC_SIZE, 1, logrec_t::t_skip);
+
+    CollectHandler first;
+    scan(logdir, cursor, first);
+    check(first.lsns.size() == 4, "first scan must deliver 4 records");
+
+    std::ifstream in(cursor.c_str());
+    string key, value;
+    in >> key >> value;
+    check(key == "lsn" && value == "1." + std::to_string(3 * REC_SIZE),
+            "cursor must point to the skip record, got " + value);
+
+    // second flush overwrites the skip record
+    writeRecords(logdir, 3 * REC_SIZE, 2, logrec_t::t_tick_sec);
+    writeRecords(logdir, 5 * REC_SIZE, 1, logrec_t::t_skip);
+
+    CollectHandler second;
+    scan(logdir, cursor, second);
+    check(second.lsns.size() == 3, "second scan must deliver 3 records");
+    if (second.lsns.size() == 3) {
+        check(second.lsns[0] == lsn_t(1, 3 * REC_SIZE)
+                && second.types[0] == logrec_t::t_tick_sec,
+                "second scan must start at the overwritten skip record");
+        check(second.lsns[1] == lsn_t(1, 4 * REC_SIZE),
+                "second scan must deliver the appended records");
+        check(second.types[2] == logrec_t::t_skip,
+                "second scan must end at the new skip record");
+    }
+
+    // nothing new: the skip record of the previous run is not delivered
+    CollectHandler third;
+    scan(logdir, cursor, third);
+    check(third.lsns.empty(), "scan without new records must be empty");
+
+    ::unlink(cursor.c_str());
+    ::unlink((logdir + "/log.1").c_str());
+    ::rmdir(logdir.c_str());
+
+    if (failures > 0) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "cursor_test passed" << endl;
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Tests of the merge planners of mergeruns, which decide which consecutive
+ * runs are merged without touching any files.
+ */
+#include "mergeruns.h"
+
+#include <iostream>
+
+/*
+ * Gives the tests access to the planners and options of a MergeRuns
+ * command (friend of MergeRuns).
+ */
+class MergePlanTest {
+public:
+    typedef MergeRuns::RunInfo RunInfo;
+    typedef MergeRuns::MergePlan MergePlan;
+
+    static void setup(MergeRuns& cmd, const string& policy, size_t fanin)
+    {
+        cmd.policy = policy;
+        cmd.fanin = fanin;
+        cmd.sizeRatio = 4;
+        cmd.maxRuns = 0;
+        cmd.minRunSize = 0;
+        cmd.maxRunSize = 0;
+    }
+
+    static void setSizeLimits(MergeRuns& cmd, size_t minRunSize,
+            size_t maxRunSize)
+    {
+        cmd.minRunSize = minRunSize;
+        cmd.maxRunSize = maxRunSize;
+    }
+
+    static void setReadAmp(MergeRuns& cmd, double sizeRatio, size_t maxRuns)
+    {
+        cmd.sizeRatio = sizeRatio;
+        cmd.maxRuns = maxRuns;
+    }
+
+    static void plan(MergeRuns& cmd, const std::vector<RunInfo>& runs,
+            MergePlan& plan)
+    {
+        cmd.planLevel(runs, plan);
+    }
+};
+
+typedef MergePlanTest::RunInfo RunInfo;
+typedef MergePlanTest::MergePlan MergePlan;
+
+static size_t failures = 0;
+
+static void check(bool cond, const string& what)
+{
+    if (!cond) {
+        cerr << "FAILED: " << what << endl;
+        failures++;
+    }
+}
+
+/*
+ * Runs of the given sizes, each adjacent to the previous one unless its
+ * index is listed in holes.
+ */
+static std::vector<RunInfo> makeRuns(const std::vector<size_t>& sizes,
+        const std::vector<size_t>& holes = std::vector<size_t>())
+{
+    std::vector<RunInfo> runs(sizes.size());
+    uint32_t lsn = 0;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (std::find(holes.begin(), holes.end(), i) != holes.end()) {
+            lsn += 100;
+        }
+        runs[i].path = "run" + std::to_string(i);
+        runs[i].begin = lsn_t(1, lsn);
+        lsn += 100;
+        runs[i].end = lsn_t(1, lsn);
+        runs[i].bytes = sizes[i];
+    }
+    return runs;
+}
+
+static void checkPlan(MergeRuns& cmd, const std::vector<size_t>& sizes,
+        const MergePlan& expected, const string& what,
+        const std::vector<size_t>& holes = std::vector<size_t>())
+{
+    MergePlan plan;
+    MergePlanTest::plan(cmd, makeRuns(sizes, holes), plan);
+    check(plan == expected, what);
+}
+
+int main()
+{
+    MergeRuns cmd;
+
+    MergePlanTest::setup(cmd, "fanin", 2);
+    checkPlan(cmd, {10, 10, 10, 10, 10}, {{0, 2}, {2, 4}},
+            "fanin: groups of fan-in runs");
+    checkPlan(cmd, {10, 10, 10, 10}, {{1, 3}},
+            "fanin: groups end at holes", {1});
+    checkPlan(cmd, {10, 10, 10}, {{0, 2}},
+            "fanin: no group across a hole", {2});
+
+    MergePlanTest::setSizeLimits(cmd, 5, 0);
+    checkPlan(cmd, {10, 1, 10, 10}, {{2, 4}},
+            "fanin: runs below minRunSize are not merged");
+    MergePlanTest::setSizeLimits(cmd, 0, 100);
+    checkPlan(cmd, {10, 1000, 10, 10}, {{2, 4}},
+            "fanin: runs above maxRunSize are not merged");
+
+    MergePlanTest::setup(cmd, "tiered", 2);
+    checkPlan(cmd, {10, 100, 10, 10}, {{2, 4}},
+            "tiered: only runs of similar size are merged");
+    MergePlanTest::setSizeLimits(cmd, 0, 100);
+    checkPlan(cmd, {1000, 10}, {},
+            "tiered: last group must not start with a run above "
+            "maxRunSize");
+    checkPlan(cmd, {10, 10, 1000, 10}, {{0, 2}},
+            "tiered: run above maxRunSize is skipped");
+    MergePlanTest::setSizeLimits(cmd, 0, 0);
+    checkPlan(cmd, {10, 10, 10}, {{1, 3}},
+            "tiered: groups must be adjacent", {1});
+
+    MergePlanTest::setup(cmd, "leveled", 4);
+    checkPlan(cmd, {8, 4, 2, 1}, {{0, 4}},
+            "leveled: runs growing with age are merged");
+    checkPlan(cmd, {100, 20, 2, 1}, {{2, 4}},
+            "leveled: much larger older runs are left alone");
+    MergePlanTest::setSizeLimits(cmd, 2, 0);
+    checkPlan(cmd, {8, 4, 2, 1}, {{0, 3}},
+            "leveled: runs below minRunSize are not merged");
+
+    MergePlanTest::setup(cmd, "tiered", 2);
+    MergePlanTest::setReadAmp(cmd, 1, 3);
+    checkPlan(cmd, {100, 1, 2, 100}, {{1, 3}},
+            "read amplification: cheapest group is added");
+    MergePlanTest::setSizeLimits(cmd, 0, 1);
+    checkPlan(cmd, {100, 1, 2, 100}, {},
+            "read amplification: size limits apply");
+
+    if (failures > 0) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "mergeplan_test passed" << endl;
+    return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * Round-trip test of the block codec of compressed archive runs (see
+ * RunCodec). Blocks resembling those of a sorted run, incompressible
+ * blocks, long repetitions and degenerate sizes must decompress to the
+ * original bytes, and truncated input must be rejected.
+ */
+#include "runcodec.h"
+
+#include <cstring>
+#include <iostream>
+#include <random>
+
+static size_t failures = 0;
+
+static void check(bool cond, const string& what)
+{
+    if (!cond) {
+        cerr << "FAILED: " << what << endl;
+        failures++;
+    }
+}
+
+static void roundTrip(const std::vector<char>& block, const string& what)
+{
+    std::vector<char> compressed;
+    RunCodec::Codec codec = RunCodec::compressBlock(block.data(),
+            block.size(), compressed);
+    check(compressed.size() <= block.size() + sizeof(uint32_t),
+            what + ": compressed block larger than input");
+
+    std::vector<char> output(block.size());
+    try {
+        RunCodec::decompressBlock(codec, compressed.data(),
+                compressed.size(), output.data(), output.size());
+    }
+    catch (runtime_error& e) {
+        check(false, what + ": " + e.what());
+        return;
+    }
+    check(output == block, what + ": output differs from input");
+}
+
+/*
+ * Builds a block of records with a header like that of log records, i.e.,
+ * starting with a two-byte length, followed by a type and a PID which
+ * changes every few records, as in a run sorted by PID.
+ */
+static void buildRun(std::mt19937& rng, size_t size, size_t maxRecord,
+        bool randomPayload, std::vector<char>& block)
+{
+    block.clear();
+    uint32_t page = rng() % 1000;
+    while (block.size() < size) {
+        uint16_t length = 16 + rng() % maxRecord;
+        if (rng() % 4 == 0) { page++; }
+
+        size_t pos = block.size();
+        block.resize(pos + length);
+        memcpy(&block[pos], &length, sizeof(length));
+        block[pos + 2] = rng() % 5;
+        memcpy(&block[pos + 4], &page, sizeof(page));
+        for (size_t i = 8; i < length; i++) {
+            block[pos + i] = randomPayload ? rng() : rng() % 4;
+        }
+    }
+}
+
+int main()
+{
+    std::mt19937 rng(42);
+    std::vector<char> block;
+
+    for (size_t i = 0; i < 100; i++) {
+        buildRun(rng, 1 + rng() % 1048576, i % 3 == 0 ? 3000 : 120,
+                i % 2 == 0, block);
+        // records cut off at the end of the block
+        if (i % 5 == 0) {
+            block.resize(block.size() - rng() % 50);
+        }
+        roundTrip(block, "run block " + std::to_string(i));
+    }
+
+    block.resize(65536);
+    for (size_t i = 0; i < block.size(); i++) {
+        block[i] = rng();
+    }
+    roundTrip(block, "random block");
+
+    // matches much longer than a length byte, which overlap their source
+    block.assign(300000, 'x');
+    roundTrip(block, "repeated byte");
+    for (size_t i = 0; i < block.size(); i++) {
+        block[i] = "abcdefg"[i % 7];
+    }
+    roundTrip(block, "repeated pattern");
+
+    for (size_t n = 0; n < 40; n++) {
+        block.assign(n, 'a');
+        if (n > 0) { block[0] = n; }
+        roundTrip(block, "block of " + std::to_string(n) + " bytes");
+    }
+
+    buildRun(rng, 65536, 120, false, block);
+    std::vector<char> compressed;
+    RunCodec::Codec codec = RunCodec::compressBlock(block.data(),
+            block.size(), compressed);
+    check(codec == RunCodec::DELTA_LZ, "sorted run block not compressed");
+    std::vector<char> output(block.size());
+    bool rejected = false;
+    try {
+        RunCodec::decompressBlock(codec, compressed.data(),
+                compressed.size() / 2, output.data(), output.size());
+    }
+    catch (runtime_error&) {
+        rejected = true;
+    }
+    check(rejected, "truncated block not rejected");
+
+    if (failures > 0) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "runcodec_test passed" << endl;
+    return 0;
+}